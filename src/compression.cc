@@ -0,0 +1,122 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+
+#include "compression.h"
+
+namespace oas {
+static std::string_view Trim(std::string_view str) {
+  while (!str.empty() && std::isspace(static_cast<unsigned char>(str.front()))) {
+    str.remove_prefix(1);
+  }
+  while (!str.empty() && std::isspace(static_cast<unsigned char>(str.back()))) {
+    str.remove_suffix(1);
+  }
+  return str;
+}
+
+static bool EqualsIgnoreCase(std::string_view a, std::string_view b) {
+  return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+           return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+         });
+}
+
+// Returns the q-value of an Accept-Encoding element's parameters ("; q=0.5"); 1 if there's none.
+static double GetQValue(std::string_view params) {
+  while (!params.empty()) {
+    auto end = params.find(';');
+    auto param = Trim(params.substr(0, end));
+    params = end == std::string_view::npos ? std::string_view() : params.substr(end + 1);
+    if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+      return std::strtod(std::string(param.substr(2)).c_str(), nullptr);
+    }
+  }
+  return 1;
+}
+
+ContentEncoding NegotiateContentEncoding(std::string_view accept_encoding) {
+  // -1 means the coding isn't listed
+  double gzip_q = -1;
+  double deflate_q = -1;
+  double any_q = -1;
+  while (!accept_encoding.empty()) {
+    auto end = accept_encoding.find(',');
+    auto element = accept_encoding.substr(0, end);
+    accept_encoding = end == std::string_view::npos ? std::string_view() : accept_encoding.substr(end + 1);
+    auto params_pos = element.find(';');
+    auto coding = Trim(element.substr(0, params_pos));
+    auto q = params_pos == std::string_view::npos ? 1 : GetQValue(element.substr(params_pos + 1));
+    if (EqualsIgnoreCase(coding, "gzip") || EqualsIgnoreCase(coding, "x-gzip")) {
+      gzip_q = q;
+    } else if (EqualsIgnoreCase(coding, "deflate")) {
+      deflate_q = q;
+    } else if (coding == "*") {
+      any_q = q;
+    }
+  }
+  if (gzip_q < 0) {
+    gzip_q = any_q;
+  }
+  if (deflate_q < 0) {
+    deflate_q = any_q;
+  }
+  if (gzip_q <= 0 && deflate_q <= 0) {
+    return ContentEncoding::kIdentity;
+  }
+  return gzip_q >= deflate_q ? ContentEncoding::kGzip : ContentEncoding::kDeflate;
+}
+
+const char* GetContentEncodingName(ContentEncoding encoding) {
+  switch (encoding) {
+    case ContentEncoding::kGzip:
+      return "gzip";
+    case ContentEncoding::kDeflate:
+      return "deflate";
+    default:
+      return "identity";
+  }
+}
+
+Compressor::Compressor(ContentEncoding encoding, int level) {
+  // 15 bits of window; +16 wraps the data in a gzip header and trailer instead of zlib's (HTTP's deflate)
+  int window_bits = encoding == ContentEncoding::kGzip ? 15 + 16 : 15;
+  is_valid = encoding != ContentEncoding::kIdentity &&
+             deflateInit2(&strm, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+Compressor::~Compressor() {
+  if (is_valid) {
+    deflateEnd(&strm);
+  }
+}
+
+bool Compressor::Compress(std::string_view data, bool last, std::string& out) {
+  if (!is_valid) {
+    return false;
+  }
+  strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  strm.avail_in = static_cast<uInt>(data.size());
+  auto flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+  while (true) {
+    // deflateBound is for a whole stream; it's a generous estimate for a piece of one
+    auto offset = out.size();
+    auto avail_out = std::max<size_t>(deflateBound(&strm, strm.avail_in), 64);
+    out.resize(offset + avail_out);
+    strm.next_out = reinterpret_cast<Bytef*>(out.data() + offset);
+    strm.avail_out = static_cast<uInt>(avail_out);
+    auto ret = deflate(&strm, flush);
+    out.resize(out.size() - strm.avail_out);
+    if (ret == Z_STREAM_ERROR) {
+      is_valid = false;
+      return false;
+    }
+    // done once the input is consumed and deflate had room to spare for the flush
+    if (last ? ret == Z_STREAM_END : strm.avail_in == 0 && strm.avail_out != 0) {
+      return true;
+    }
+  }
+}
+}  // namespace oas
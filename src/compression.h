@@ -0,0 +1,37 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include <zlib.h>
+
+namespace oas {
+enum class ContentEncoding { kIdentity, kGzip, kDeflate };
+
+// Returns the encoding to compress a response with given the request's Accept-Encoding header: gzip or
+// deflate, whichever the client prefers by q-value (gzip on a tie), or identity if it accepts neither.
+ContentEncoding NegotiateContentEncoding(std::string_view accept_encoding);
+// The name of the encoding in the Content-Encoding header.
+const char* GetContentEncodingName(ContentEncoding encoding);
+
+// Compresses a response body in one go or, for streams, piece by piece.
+class Compressor {
+ public:
+  // level is a zlib compression level (1-9).
+  Compressor(ContentEncoding encoding, int level);
+  ~Compressor();
+  Compressor(const Compressor&) = delete;
+  Compressor& operator=(const Compressor&) = delete;
+
+  // Appends data compressed to out. Unless last, the output is flushed so that the client can decode all of
+  // data right away; if last, the compressed stream is ended. Returns false on a zlib error.
+  bool Compress(std::string_view data, bool last, std::string& out);
+
+ private:
+  z_stream strm{};
+  bool is_valid = false;
+};
+}  // namespace oas
@@ -0,0 +1,50 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <algorithm>
+#include <cmath>
+
+#include "concurrency_limiter.h"
+
+namespace oas {
+namespace {
+constexpr double kRecentSmoothingFactor = 0.2;
+// The baseline follows improvements quickly but only drifts up slowly, so that a sustained
+// overload doesn't become the new normal.
+constexpr double kBaselineRiseSmoothingFactor = 0.001;
+constexpr double kLimitSmoothingFactor = 0.2;
+// Never shrink the limit by more than half in one step.
+constexpr double kMinGradient = 0.5;
+}  // namespace
+
+ConcurrencyLimiter::ConcurrencyLimiter(size_t min_limit0, size_t max_limit0, double latency_tolerance0)
+    : min_limit(std::max<size_t>(1, std::min(min_limit0, max_limit0))),
+      max_limit(std::max<size_t>(1, max_limit0)),
+      latency_tolerance(latency_tolerance0),
+      limit(static_cast<double>(max_limit)) {
+}
+
+void ConcurrencyLimiter::OnSample(double step_latency_ms, size_t in_flight) {
+  if (!baseline_latency_ms) {
+    recent_latency_ms = baseline_latency_ms = step_latency_ms;
+    return;
+  }
+  recent_latency_ms += kRecentSmoothingFactor * (step_latency_ms - recent_latency_ms);
+  auto baseline_smoothing = step_latency_ms < baseline_latency_ms ? kRecentSmoothingFactor : kBaselineRiseSmoothingFactor;
+  baseline_latency_ms += baseline_smoothing * (step_latency_ms - baseline_latency_ms);
+  // a batch that isn't even half full says nothing about the right limit
+  if (in_flight < limit / 2) {
+    return;
+  }
+  auto gradient = std::clamp(latency_tolerance * baseline_latency_ms / recent_latency_ms, kMinGradient, 1.0);
+  // only probe for headroom while latency is tolerated; added to a shrinking limit it would keep the limit
+  // from ever dropping below 4 (limit * kMinGradient + sqrt(limit) == limit)
+  auto new_limit = gradient < 1 ? limit * gradient : limit + std::sqrt(limit);
+  limit = std::clamp(limit + kLimitSmoothingFactor * (new_limit - limit),
+                     static_cast<double>(min_limit), static_cast<double>(max_limit));
+}
+
+size_t ConcurrencyLimiter::GetLimit() const {
+  return static_cast<size_t>(limit);
+}
+}  // namespace oas
@@ -0,0 +1,33 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <cstddef>
+
+namespace oas {
+// Gradient based limit on the number of requests a model decodes concurrently.
+// Beyond some batch size extra concurrency only makes every step slower, so the limit is
+// adjusted from the observed step latency: whenever the recent latency exceeds the long term
+// (baseline) one by more than the tolerance, it's scaled down by the ratio of the tolerated latency
+// (baseline * tolerance) to the recent one, down to min_limit; otherwise it's nudged up by sqrt(limit).
+// Not thread safe; the owning engine serializes access.
+class ConcurrencyLimiter {
+ public:
+  ConcurrencyLimiter(size_t min_limit0, size_t max_limit0, double latency_tolerance0);
+
+  // Feeds the latency of one decode step taken with in_flight requests in the batch.
+  void OnSample(double step_latency_ms, size_t in_flight);
+  size_t GetLimit() const;
+  double GetRecentLatencyMs() const { return recent_latency_ms; }
+  double GetBaselineLatencyMs() const { return baseline_latency_ms; }
+
+ private:
+  const size_t min_limit;
+  const size_t max_limit;
+  const double latency_tolerance;
+  double limit;
+  double recent_latency_ms = 0;
+  double baseline_latency_ms = 0;
+};
+}  // namespace oas
@@ -0,0 +1,530 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <algorithm>
+#include <cmath>
+#include "spdlog/spdlog.h"
+
+#include "generation_engine.h"
+
+namespace oas {
+namespace {
+constexpr double kStatsSmoothingFactor = 0.2;
+// Estimated length of a response when the client doesn't cap it with max_length.
+constexpr size_t kDefaultNewTokensEstimate = 256;
+// Rough cost of prefilling one prompt token relative to decoding one new token.
+constexpr double kPrefillTokenCost = 0.05;
+// How often a queued request checks whether its client is still connected.
+constexpr std::chrono::milliseconds kClientCheckInterval{100};
+
+double ElapsedMs(std::chrono::steady_clock::time_point since) {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+void UpdateMovingAverage(double& avg, double sample, size_t num_samples) {
+  avg = num_samples == 1 ? sample : avg + kStatsSmoothingFactor * (sample - avg);
+}
+}  // namespace
+
+GenerationRequest::GenerationRequest(std::vector<int32_t> prompt_tokens0, std::unique_ptr<OgaGeneratorParams> params0)
+    : prompt_tokens(std::move(prompt_tokens0)), params(std::move(params0)), num_prompt_tokens(prompt_tokens.size()) {
+  if (params) {
+    params->SetInputIDs(prompt_tokens.data(), prompt_tokens.size(), prompt_tokens.size(), 1);
+  }
+}
+
+bool GenerationRequest::GetToken(size_t index, int32_t& token) {
+  std::unique_lock<std::mutex> lock(mtx);
+  cv.wait(lock, [this, index] { return index < tokens.size() || done; });
+  if (index >= tokens.size()) {
+    return false;
+  }
+  token = tokens[index];
+  return true;
+}
+
+bool GenerationRequest::WaitForToken(size_t index, std::chrono::steady_clock::time_point until) {
+  std::unique_lock<std::mutex> lock(mtx);
+  return cv.wait_until(lock, until, [this, index] { return index < tokens.size() || done; });
+}
+
+bool GenerationRequest::WaitForCompletion(std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(mtx);
+  return cv.wait_for(lock, timeout, [this] { return done; });
+}
+
+std::string GenerationRequest::GetError() {
+  std::lock_guard<std::mutex> lock(mtx);
+  return error;
+}
+
+size_t GenerationRequest::EstimateNewTokens() const {
+  if (!max_length) {
+    return kDefaultNewTokensEstimate;
+  }
+  return max_length > num_prompt_tokens ? max_length - num_prompt_tokens : 1;
+}
+
+double GenerationRequest::EstimateCost() const {
+  return num_prompt_tokens * kPrefillTokenCost + EstimateNewTokens();
+}
+
+bool GenerationRequest::IsAdmitted() {
+  std::lock_guard<std::mutex> lock(mtx);
+  return admitted;
+}
+
+void GenerationRequest::Cancel() {
+  std::lock_guard<std::mutex> lock(mtx);
+  if (!done) {
+    cancelled = true;
+  }
+}
+
+bool GenerationRequest::WaitUntilAdmitted(const std::function<bool()>& is_client_gone) {
+  std::unique_lock<std::mutex> lock(mtx);
+  auto is_admitted = [this] { return admitted || done; };
+  if (!is_client_gone) {
+    cv.wait(lock, is_admitted);
+    return admitted;
+  }
+  while (!cv.wait_for(lock, kClientCheckInterval, is_admitted)) {
+    lock.unlock();
+    bool gone = is_client_gone();
+    lock.lock();
+    if (gone) {
+      break;
+    }
+  }
+  return admitted;
+}
+
+void GenerationRequest::Abandon(const std::string& err) {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (admitted || done) {
+      return;
+    }
+    done = true;
+    error = err;
+  }
+  cv.notify_all();
+}
+
+void GenerationRequest::Admit() {
+  admit_time = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    admitted = true;
+  }
+  cv.notify_all();
+}
+
+void GenerationRequest::PushToken(int32_t token) {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    tokens.push_back(token);
+  }
+  cv.notify_all();
+}
+
+void GenerationRequest::Finish(const std::string& err) {
+  generator.reset();
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    done = true;
+    error = err;
+  }
+  cv.notify_all();
+}
+
+GenerationEngine::GenerationEngine(const OgaModel& oga_model0, const EngineConfig& config0,
+                                   const KvCacheSpec& kv_cache_spec0, InferenceWorkerPool& worker_pool0)
+    : oga_model(oga_model0),
+      config(config0),
+      kv_cache_spec(kv_cache_spec0),
+      kv_cache_bytes_per_token(kv_cache_spec0.IsValid() ? kv_cache_spec0.BytesPerToken(config0.kv_cache_bytes_per_element) : 0),
+      kv_cache_budget_bytes(kv_cache_bytes_per_token ? config0.kv_cache_budget_mb * 1024 * 1024 : 0),
+      worker_pool(worker_pool0),
+      pending(config0.tenant_weights, CreateQueuePolicy(config0.queue_policy, config0.sjf_aging_tokens_per_sec)),
+      limiter(config0.min_concurrency, config0.max_batch_size, config0.concurrency_latency_tolerance) {
+}
+
+GenerationEngine::~GenerationEngine() {
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    stop = true;
+    cv.wait(lock, [this] { return !iteration_scheduled && prefilling.empty(); });
+  }
+  for (auto& request : active) {
+    request->Finish("Model engine was shut down");
+  }
+  for (auto& request : pending.RemoveAll()) {
+    request->Finish("Model engine was shut down");
+  }
+}
+
+Status GenerationEngine::Submit(std::shared_ptr<GenerationRequest> request) {
+  request->enqueue_time = std::chrono::steady_clock::now();
+  if (config.default_request_timeout_ms && request->deadline == std::chrono::steady_clock::time_point::max()) {
+    request->deadline = request->enqueue_time + std::chrono::milliseconds(config.default_request_timeout_ms);
+  }
+  // The generator reserves the cache for max_length tokens up front.
+  auto max_tokens = request->max_length ? request->max_length : kv_cache_spec.default_max_length;
+  if (!max_tokens) {
+    max_tokens = request->num_prompt_tokens + request->EstimateNewTokens();
+  }
+  // every beam and returned sequence keeps a cache of its own
+  auto num_beams = request->num_beams ? request->num_beams : kv_cache_spec.default_num_beams;
+  auto num_return_sequences =
+      request->num_return_sequences ? request->num_return_sequences : kv_cache_spec.default_num_return_sequences;
+  request->kv_cache_bytes = max_tokens * num_beams * num_return_sequences * kv_cache_bytes_per_token;
+  if (kv_cache_budget_bytes && request->kv_cache_bytes > kv_cache_budget_bytes) {
+    return Status::kKvCacheBudgetExceeded;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (config.max_queue_depth && pending.Size() >= config.max_queue_depth) {
+      PurgeCancelledPending();
+      if (pending.Size() >= config.max_queue_depth) {
+        ++stats.num_rejected;
+        return Status::kQueueFull;
+      }
+    }
+    pending.Push(std::move(request));
+    stats.max_queue_depth = std::max(stats.max_queue_depth, pending.Size());
+    if (iteration_scheduled) {
+      return Status::kOk;
+    }
+    iteration_scheduled = true;
+  }
+  worker_pool.Enqueue([this] { RunIteration(); });
+  return Status::kOk;
+}
+
+Status GenerationEngine::WaitForAdmission(GenerationRequest& request, const std::function<bool()>& is_client_gone,
+                                          const std::function<bool()>& release) {
+  auto queue_deadline = config.max_queue_wait_ms
+                            ? request.enqueue_time + std::chrono::milliseconds(config.max_queue_wait_ms)
+                            : std::chrono::steady_clock::time_point::max();
+  auto wait_until = std::min(queue_deadline, request.deadline);
+  std::unique_lock<std::mutex> lock(request.mtx);
+  auto is_admitted = [&request] { return request.admitted || request.done; };
+  // returns whether the request was cancelled
+  auto give_up = [&request, &release] {
+    if (release && !release()) {
+      return false;
+    }
+    request.Cancel();
+    return true;
+  };
+  bool timed_out = false;
+  if (!is_client_gone) {
+    if (wait_until == std::chrono::steady_clock::time_point::max()) {
+      request.cv.wait(lock, is_admitted);
+    } else {
+      timed_out = !request.cv.wait_until(lock, wait_until, is_admitted);
+    }
+  } else {
+    while (!request.cv.wait_until(lock, std::min(wait_until, std::chrono::steady_clock::now() + kClientCheckInterval),
+                                  is_admitted)) {
+      if (std::chrono::steady_clock::now() >= wait_until) {
+        timed_out = true;
+        break;
+      }
+      lock.unlock();
+      bool gone = is_client_gone();
+      lock.lock();
+      if (gone && !is_admitted()) {
+        lock.unlock();
+        if (give_up()) {
+          std::lock_guard<std::mutex> engine_lock(mtx);
+          ++stats.num_cancelled;
+        }
+        return Status::kCancelled;
+      }
+    }
+  }
+  if (timed_out) {
+    lock.unlock();
+    bool cancelled = give_up();
+    std::lock_guard<std::mutex> engine_lock(mtx);
+    if (request.deadline <= queue_deadline) {
+      stats.num_deadline_exceeded += cancelled;
+      return Status::kDeadlineExceeded;
+    }
+    stats.num_queue_timeouts += cancelled;
+    return Status::kQueueTimeout;
+  }
+  return request.admitted ? Status::kOk : Status::kFail;
+}
+
+size_t GenerationEngine::EstimateRetryAfterSecs() {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto batches_ahead = static_cast<double>(pending.Size()) / GetConcurrencyLimit();
+  auto wait_secs = std::ceil(batches_ahead * stats.avg_service_time_ms / 1000);
+  return std::max<size_t>(1, static_cast<size_t>(wait_secs));
+}
+
+EngineStats GenerationEngine::GetStats() {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto ret = stats;
+  ret.active = active.size();
+  ret.prefilling = prefilling.size();
+  ret.kv_cache_bytes_per_token = kv_cache_bytes_per_token;
+  ret.kv_cache_bytes_in_use = kv_cache_bytes_in_use;
+  ret.kv_cache_budget_bytes = kv_cache_budget_bytes;
+  ret.queue_depth = pending.Size();
+  ret.concurrency_limit = GetConcurrencyLimit();
+  ret.avg_step_latency_ms = limiter.GetRecentLatencyMs();
+  ret.baseline_step_latency_ms = limiter.GetBaselineLatencyMs();
+  for (size_t i = 0; i < kNumRequestPriorities; ++i) {
+    ret.priority_classes[i].queue_depth = pending.Size(static_cast<RequestPriority>(i));
+  }
+  ret.tenants = pending.GetTenantStats();
+  for (auto& request : active) {
+    ++ret.tenants[request->tenant].active;
+  }
+  for (auto& request : prefilling) {
+    ++ret.tenants[request->tenant].active;
+  }
+  return ret;
+}
+
+size_t GenerationEngine::GetConcurrencyLimit() const {
+  return config.adaptive_concurrency ? limiter.GetLimit() : config.max_batch_size;
+}
+
+void GenerationEngine::PurgeCancelledPending() {
+  for (auto& request : pending.RemoveCancelled()) {
+    request->Finish();
+  }
+}
+
+void GenerationEngine::RecordCompletion(const GenerationRequest& request) {
+  pending.OnCompleted(request);
+  kv_cache_bytes_in_use -= request.kv_cache_bytes;
+  ++stats.num_completed;
+  UpdateMovingAverage(stats.avg_service_time_ms, ElapsedMs(request.admit_time), stats.num_completed);
+  if (request.IsCancelled()) {
+    ++stats.num_cancelled;
+    return;
+  }
+  if (request.IsDeadlineExceeded()) {
+    ++stats.num_deadline_exceeded;
+    return;
+  }
+  auto& class_stats = stats.priority_classes[static_cast<size_t>(request.priority)];
+  ++class_stats.num_completed;
+  auto latency_ms = ElapsedMs(request.enqueue_time);
+  UpdateMovingAverage(class_stats.avg_latency_ms, latency_ms, class_stats.num_completed);
+  auto ttft_ms = request.has_first_token
+                     ? std::chrono::duration<double, std::milli>(request.first_token_time - request.enqueue_time).count()
+                     : latency_ms;
+  UpdateMovingAverage(class_stats.avg_ttft_ms, ttft_ms, class_stats.num_completed);
+  bool slo_met = request.priority == RequestPriority::kInteractive ? ttft_ms <= config.interactive_ttft_slo_ms
+                                                                    : latency_ms <= config.batch_latency_slo_ms;
+  if (slo_met) {
+    ++class_stats.num_slo_met;
+  }
+}
+
+void GenerationEngine::RunIteration() {
+  AdmitPending();
+  // Iterate over a copy since finished prefills and the last step task to finish modify active.
+  std::vector<std::shared_ptr<GenerationRequest>> batch;
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    batch = active;
+  }
+  // reset before an empty batch too, or FinishIteration would count the previous iteration again
+  iteration_decode_us = 0;
+  iteration_decode_steps = 0;
+  if (batch.empty()) {
+    FinishIteration();
+    return;
+  }
+  steps_remaining = batch.size();
+  for (auto& request : batch) {
+    worker_pool.Enqueue([this, request] {
+      StepRequest(*request);
+      if (--steps_remaining == 0) {
+        FinishIteration();
+      }
+    });
+  }
+}
+
+void GenerationEngine::AdmitPending() {
+  std::vector<std::shared_ptr<GenerationRequest>> admitted;
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    PurgeCancelledPending();
+    auto max_batch_size = GetConcurrencyLimit();
+    // Batch requests can't take the slots reserved for interactive ones.
+    auto max_batch_priority_slots = max_batch_size - std::min(config.interactive_reserved_slots, max_batch_size - 1);
+    // A tenant can't hold more than its share of the batch while other tenants are waiting.
+    auto max_tenant_slots = std::max<size_t>(1, static_cast<size_t>(std::ceil(config.max_tenant_batch_share * max_batch_size)));
+    size_t num_batch_priority = 0;
+    bool kv_cache_full = false;
+    std::unordered_map<std::string, size_t> tenant_slots;
+    auto add_to_batch = [&](const GenerationRequest& request) {
+      if (request.priority == RequestPriority::kBatch) {
+        ++num_batch_priority;
+      }
+      ++tenant_slots[request.tenant];
+    };
+    for (auto& request : active) {
+      add_to_batch(*request);
+    }
+    for (auto& request : prefilling) {
+      add_to_batch(*request);
+    }
+    auto can_admit = [&](const GenerationRequest& request) {
+      if (request.priority == RequestPriority::kBatch && num_batch_priority >= max_batch_priority_slots) {
+        return false;
+      }
+      // A prompt longer than the prefill budget is prefilled on its own.
+      if (prefill_tokens_in_flight && prefill_tokens_in_flight + request.num_prompt_tokens > config.max_prefill_tokens_in_flight) {
+        return false;
+      }
+      if (kv_cache_budget_bytes && kv_cache_bytes_in_use + request.kv_cache_bytes > kv_cache_budget_bytes) {
+        kv_cache_full = true;
+        return false;
+      }
+      return tenant_slots[request.tenant] < max_tenant_slots || pending.NumBackloggedTenants() <= 1;
+    };
+    while (active.size() + prefilling.size() < max_batch_size) {
+      auto request = pending.Pop(can_admit);
+      if (!request) {
+        break;
+      }
+      add_to_batch(*request);
+      ++stats.num_admitted;
+      auto queue_wait_ms = ElapsedMs(request->enqueue_time);
+      UpdateMovingAverage(stats.avg_queue_wait_ms, queue_wait_ms, stats.num_admitted);
+      stats.max_queue_wait_ms = std::max(stats.max_queue_wait_ms, queue_wait_ms);
+      request->Admit();
+      prefill_tokens_in_flight += request->num_prompt_tokens;
+      kv_cache_bytes_in_use += request->kv_cache_bytes;
+      prefilling.push_back(request);
+      admitted.push_back(std::move(request));
+    }
+    if (kv_cache_full) {
+      ++stats.num_kv_cache_stalls;
+    }
+  }
+  for (auto& request : admitted) {
+    worker_pool.Enqueue([this, request] { PrefillRequest(request); });
+  }
+}
+
+void GenerationEngine::PrefillRequest(const std::shared_ptr<GenerationRequest>& request) {
+  auto prefill_start = std::chrono::steady_clock::now();
+  if (!DropIfExpired(*request)) {
+    try {
+      request->generator = OgaGenerator::Create(oga_model, *request->params);
+      if (request->generator->IsDone()) {
+        request->Finish();
+      } else {
+        StepRequest(*request);
+      }
+    } catch (const std::exception& e) {
+      spdlog::error("Failed to create generator: {}", e.what());
+      request->Finish(e.what());
+    }
+  }
+  bool schedule_iteration = false;
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    prefilling.erase(std::find(prefilling.begin(), prefilling.end(), request));
+    prefill_tokens_in_flight -= request->num_prompt_tokens;
+    if (request->has_first_token) {
+      auto prefill_ms = ElapsedMs(prefill_start);
+      ++stats.num_prefills;
+      UpdateMovingAverage(stats.avg_prefill_ms, prefill_ms, stats.num_prefills);
+      stats.prefill_time_ms += prefill_ms;
+    }
+    if (request->generator) {
+      active.push_back(request);
+    } else {
+      RecordCompletion(*request);
+    }
+    if (stop) {
+      cv.notify_all();
+    } else if (!iteration_scheduled && (!active.empty() || pending.Size())) {
+      iteration_scheduled = schedule_iteration = true;
+    }
+  }
+  if (schedule_iteration) {
+    worker_pool.Enqueue([this] { RunIteration(); });
+  }
+}
+
+bool GenerationEngine::DropIfExpired(GenerationRequest& request) {
+  if (request.IsCancelled()) {
+    spdlog::debug("Dropping cancelled request from the batch");
+    request.Finish();
+    return true;
+  }
+  if (std::chrono::steady_clock::now() >= request.deadline) {
+    spdlog::debug("Dropping request that ran past its deadline from the batch");
+    request.deadline_exceeded = true;
+    request.Finish("Request deadline exceeded");
+    return true;
+  }
+  return false;
+}
+
+void GenerationEngine::StepRequest(GenerationRequest& request) {
+  if (DropIfExpired(request)) {
+    return;
+  }
+  auto& generator = request.generator;
+  try {
+    auto step_start = std::chrono::steady_clock::now();
+    generator->ComputeLogits();
+    generator->GenerateNextToken();
+    if (request.has_first_token) {
+      iteration_decode_us += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - step_start).count();
+      ++iteration_decode_steps;
+    }
+    const auto num_tokens = generator->GetSequenceCount(0);
+    if (!request.has_first_token) {
+      request.has_first_token = true;
+      request.first_token_time = std::chrono::steady_clock::now();
+    }
+    ++request.num_generated_tokens;
+    request.PushToken(generator->GetSequenceData(0)[num_tokens - 1]);
+    if (generator->IsDone()) {
+      request.Finish();
+    }
+  } catch (const std::exception& e) {
+    spdlog::error("Generation step failed: {}", e.what());
+    request.Finish(e.what());
+  }
+}
+
+void GenerationEngine::FinishIteration() {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    stats.decode_time_ms += iteration_decode_us / 1000.0;
+    if (config.adaptive_concurrency && iteration_decode_steps) {
+      limiter.OnSample(iteration_decode_us / 1000.0 / iteration_decode_steps, active.size());
+    }
+    auto it = std::stable_partition(active.begin(), active.end(),
+                                    [](const auto& request) { return static_cast<bool>(request->generator); });
+    for (auto fit = it; fit != active.end(); ++fit) {
+      RecordCompletion(**fit);
+    }
+    active.erase(it, active.end());
+    // With nothing to step the iterations pause; the prefills in flight resume them.
+    if (stop || (active.empty() && (!pending.Size() || !prefilling.empty()))) {
+      iteration_scheduled = false;
+      cv.notify_all();
+      return;
+    }
+  }
+  worker_pool.Enqueue([this] { RunIteration(); });
+}
+}  // namespace oas
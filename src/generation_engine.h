@@ -0,0 +1,254 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ort_genai.h"
+#include "utils.h"
+#include "concurrency_limiter.h"
+#include "inference_worker_pool.h"
+#include "request_scheduler.h"
+
+namespace oas {
+struct EngineConfig {
+  size_t max_batch_size = 8;  // max number of requests stepped together by a model's engine
+  size_t num_inference_threads = std::max(1u, std::thread::hardware_concurrency());  // shared by all models
+  size_t max_queue_depth = 64;     // max requests waiting for a slot in the batch; 0 means unbounded
+  size_t max_queue_wait_ms = 30000;  // max time a request waits for a slot in the batch; 0 means no limit
+  size_t interactive_reserved_slots = 2;  // batch slots that batch priority requests can't occupy
+  size_t interactive_ttft_slo_ms = 1000;  // target time to first token for interactive requests
+  size_t batch_latency_slo_ms = 60000;    // target end-to-end latency for batch requests
+  std::unordered_map<std::string, double> tenant_weights;  // fair share weights; tenants not listed get 1
+  double max_tenant_batch_share = 0.5;  // share of the batch a tenant can hold while other tenants are waiting
+  size_t default_request_timeout_ms = 0;  // deadline for requests that don't set their own; 0 means none
+  std::string queue_policy = "fcfs";  // order of a tenant's queued requests: fcfs or sjf (shortest job first)
+  double sjf_aging_tokens_per_sec = 100;  // how fast a waiting request's estimated cost decays under sjf
+  bool adaptive_concurrency = true;  // adjust each model's batch limit (up to max_batch_size) from its step latency
+  size_t min_concurrency = 1;        // lower bound of the adaptive batch limit
+  double concurrency_latency_tolerance = 1.5;  // step latency over the baseline tolerated before the limit shrinks
+  // max prompt tokens being prefilled at once; a longer prompt is still prefilled on its own, in one go
+  size_t max_prefill_tokens_in_flight = 512;
+  size_t kv_cache_budget_mb = 0;  // KV cache memory the requests of a model may hold; 0 means no limit
+  size_t kv_cache_bytes_per_element = 2;  // size of a KV cache element (2 for fp16, 4 for fp32)
+  size_t response_cache_mb = 64;  // memory for the responses of deterministic requests kept per model; 0 disables it
+  size_t tokenization_cache_mb = 0;  // memory for token ids of prompt segments kept per model; 0 disables it
+  bool token_text_table = false;  // decode streamed tokens with a table built from the model's tokenizer.json
+  bool coalesce_requests = true;  // identical deterministic requests in flight together share one generation
+  // memory all loaded models may take up; least recently used idle models are evicted to make room for new
+  // ones; 0 means no limit
+  size_t model_memory_budget_mb = 0;
+  size_t model_idle_ttl_secs = 0;  // models without requests for this long are unloaded; 0 means never
+};
+
+// Shape of a model's KV cache as read from its genai_config.json.
+struct KvCacheSpec {
+  size_t num_layers = 0;
+  size_t num_kv_heads = 0;
+  size_t head_size = 0;
+  size_t default_max_length = 0;  // max_length the generator uses when the request doesn't set one
+  size_t default_num_beams = 1;
+  size_t default_num_return_sequences = 1;
+
+  bool IsValid() const { return num_layers && num_kv_heads && head_size; }
+  // Keys and values of every layer.
+  size_t BytesPerToken(size_t bytes_per_element) const { return 2 * num_layers * num_kv_heads * head_size * bytes_per_element; }
+};
+
+struct PriorityClassStats {
+  size_t queue_depth = 0;
+  size_t num_completed = 0;
+  size_t num_slo_met = 0;  // completed requests that met the latency target of their class
+  double avg_ttft_ms = 0;  // moving average of submission to first token
+  double avg_latency_ms = 0;  // moving average of submission to completion
+};
+
+struct EngineStats {
+  size_t active = 0;  // requests in the running batch
+  size_t prefilling = 0;  // admitted requests whose prompt is being prefilled
+  size_t queue_depth = 0;  // requests waiting for a slot in the batch
+  size_t max_queue_depth = 0;
+  size_t concurrency_limit = 0;  // current max number of requests in the batch
+  double avg_step_latency_ms = 0;  // recent latency of a decode step of the batch
+  double baseline_step_latency_ms = 0;  // long term latency of a decode step the limiter compares against
+  size_t num_admitted = 0;
+  size_t num_completed = 0;
+  size_t num_rejected = 0;  // shed because the queue was full
+  size_t num_queue_timeouts = 0;  // shed because they waited longer than max_queue_wait_ms
+  size_t num_cancelled = 0;  // dropped because the client went away
+  size_t num_deadline_exceeded = 0;  // dropped because they ran past their deadline
+  double avg_queue_wait_ms = 0;  // moving average over admitted requests
+  double max_queue_wait_ms = 0;
+  double avg_service_time_ms = 0;  // moving average of admission to completion
+  size_t num_prefills = 0;
+  double avg_prefill_ms = 0;  // moving average of generator creation and the first step
+  double prefill_time_ms = 0;  // total time spent prefilling prompts
+  double decode_time_ms = 0;  // total time spent in decode steps
+  size_t kv_cache_bytes_per_token = 0;  // 0 if the model's KV cache shape is unknown
+  size_t kv_cache_bytes_in_use = 0;  // estimated KV cache held by the admitted requests
+  size_t kv_cache_budget_bytes = 0;
+  size_t num_kv_cache_stalls = 0;  // admission rounds held back because the KV cache budget was used up
+  std::array<PriorityClassStats, kNumRequestPriorities> priority_classes;
+  std::unordered_map<std::string, TenantStats> tenants;
+};
+
+// A single generation submitted to a GenerationEngine.
+// The submitter prepares the params; the engine owns the generator and the decode loop
+// and hands back the newly generated tokens one at a time.
+// Generated tokens are kept until the request is destroyed, so several clients subscribed to the same
+// generation can each read all of them, whenever they joined.
+struct GenerationRequest {
+  // Sets the prompt as the input of params; the params refer to prompt_tokens rather than copying them.
+  // Requests without params can be queued and scheduled but not run.
+  GenerationRequest(std::vector<int32_t> prompt_tokens0, std::unique_ptr<OgaGeneratorParams> params0);
+
+  // Blocks until the index-th generated token is available. Returns false once generation has finished
+  // (or failed) without producing it.
+  bool GetToken(size_t index, int32_t& token);
+  // Blocks until the index-th generated token is available, generation has finished or the time has come.
+  // Returns false if it timed out, i.e. GetToken() would still block.
+  bool WaitForToken(size_t index, std::chrono::steady_clock::time_point until);
+  // Blocks until generation has finished or the timeout expired. Returns true if it has finished.
+  bool WaitForCompletion(std::chrono::milliseconds timeout);
+  // Asks the engine to drop this request at the next step boundary. Does nothing once generation has
+  // finished, so that clients still reading the tokens of a shared generation get all of them.
+  void Cancel();
+  bool IsCancelled() const { return cancelled; }
+  // Returns the error (if any) that terminated the generation. Valid once GetToken() returned false.
+  std::string GetError();
+  bool IsAdmitted();
+  // Blocks until the engine admitted the request or it ended without running. Returns true if it was admitted.
+  // If given, is_client_gone is polled while waiting and the wait ends once it returns true.
+  bool WaitUntilAdmitted(const std::function<bool()>& is_client_gone = nullptr);
+  // Ends a request the engine didn't admit (e.g. it was shed) so that whoever waits on it stops waiting.
+  void Abandon(const std::string& err);
+  bool IsDeadlineExceeded() const { return deadline_exceeded; }
+
+  // Number of new tokens the request is expected to generate; used to estimate its cost before it runs.
+  size_t EstimateNewTokens() const;
+  // Estimated work of the request in decode-step equivalents (prefill is much cheaper per token than decode).
+  double EstimateCost() const;
+  size_t GetNumGeneratedTokens() const { return num_generated_tokens; }
+  std::chrono::steady_clock::time_point GetEnqueueTime() const { return enqueue_time; }
+
+  const std::vector<int32_t> prompt_tokens;
+  std::unique_ptr<OgaGeneratorParams> params;
+  const size_t num_prompt_tokens;
+  size_t max_length = 0;  // max_length search option if the client supplied one
+  size_t num_beams = 0;  // num_beams search option if the client supplied one
+  size_t num_return_sequences = 0;  // num_return_sequences search option if the client supplied one
+  size_t kv_cache_bytes = 0;  // estimated by the engine on submission
+  // Identifies deterministic requests that produce the same response; empty if the request samples.
+  // Used by the model's response cache and to coalesce identical requests in flight.
+  std::string deterministic_key;
+  RequestPriority priority = RequestPriority::kInteractive;
+  std::string tenant = kDefaultTenant;
+  // The engine drops the request once it runs past its deadline.
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+
+ private:
+  friend class GenerationEngine;
+  void PushToken(int32_t token);
+  void Finish(const std::string& err = "");
+
+  void Admit();
+
+  std::unique_ptr<OgaGenerator> generator;  // only touched by the engine's step tasks
+  std::chrono::steady_clock::time_point enqueue_time = std::chrono::steady_clock::now();  // reset on submission
+  std::chrono::steady_clock::time_point admit_time;
+  std::chrono::steady_clock::time_point first_token_time;
+  bool has_first_token = false;  // only touched by the engine's step tasks
+  std::atomic<size_t> num_generated_tokens{0};
+  std::atomic<bool> cancelled{false};
+  std::atomic<bool> deadline_exceeded{false};
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::vector<int32_t> tokens;  // all tokens generated so far
+  bool admitted = false;
+  bool done = false;
+  std::string error;
+};
+
+// Owns the decode loop of a single model.
+// New requests join the running batch at step boundaries and finished ones leave it, so
+// concurrent users of the same model are interleaved one token at a time instead of each
+// request running its own loop to completion.
+// Every iteration of the loop runs on the shared InferenceWorkerPool: the requests in the batch
+// are stepped as separate tasks and the last one to finish schedules the next iteration.
+// The size of the batch is capped by a ConcurrencyLimiter fed with the average latency of the
+// decode steps of each iteration.
+// Admitted requests are prefilled as separate tasks alongside the iterations and join the batch
+// once their first token is out, so a long prompt doesn't stall the other streams of the model.
+// The prompt tokens being prefilled at once are bounded by max_prefill_tokens_in_flight; prompts aren't split.
+// Requests are only admitted while the KV cache they are estimated to hold fits in kv_cache_budget_mb.
+class GenerationEngine {
+ public:
+  GenerationEngine(const OgaModel& oga_model0, const EngineConfig& config0, const KvCacheSpec& kv_cache_spec0,
+                   InferenceWorkerPool& worker_pool0);
+  ~GenerationEngine();
+  GenerationEngine(const GenerationEngine&) = delete;
+  GenerationEngine& operator=(const GenerationEngine&) = delete;
+
+  // Queues the request for the next step boundary. Returns kQueueFull if the admission queue is full or
+  // kKvCacheBudgetExceeded if the request alone needs more KV cache than the model's budget.
+  Status Submit(std::shared_ptr<GenerationRequest> request);
+  // Blocks until the request joins the batch. Returns kQueueTimeout (and cancels the request)
+  // if that takes longer than max_queue_wait_ms, or kDeadlineExceeded if the request's deadline
+  // expires first. If given, is_client_gone is polled while waiting; once it returns true the request
+  // is cancelled and kCancelled returned so a client that went away doesn't keep its place in the queue.
+  // If given, release is called instead when the wait ends without admission and decides whether the request
+  // is cancelled; a shared request keeps its place while others still wait for it.
+  Status WaitForAdmission(GenerationRequest& request, const std::function<bool()>& is_client_gone = nullptr,
+                          const std::function<bool()>& release = nullptr);
+  // Seconds a shed client should wait before retrying, estimated from the queue depth and
+  // the average time a request spends in the batch.
+  size_t EstimateRetryAfterSecs();
+  EngineStats GetStats();
+
+ private:
+  void RunIteration();
+  void AdmitPending();
+  void PrefillRequest(const std::shared_ptr<GenerationRequest>& request);
+  void StepRequest(GenerationRequest& request);
+  void FinishIteration();
+  size_t GetConcurrencyLimit() const;
+  void PurgeCancelledPending();
+  void RecordCompletion(const GenerationRequest& request);
+  bool DropIfExpired(GenerationRequest& request);
+
+  const OgaModel& oga_model;
+  const EngineConfig config;
+  const KvCacheSpec kv_cache_spec;
+  const size_t kv_cache_bytes_per_token;
+  const size_t kv_cache_budget_bytes;  // 0 means no limit
+  InferenceWorkerPool& worker_pool;
+  std::vector<std::shared_ptr<GenerationRequest>> active;  // stepped by the iterations; finished prefills join it
+  std::vector<std::shared_ptr<GenerationRequest>> prefilling;
+  size_t prefill_tokens_in_flight = 0;
+  size_t kv_cache_bytes_in_use = 0;
+  std::atomic<size_t> steps_remaining{0};
+  // Time spent in the decode steps of the iteration in flight; prefill steps aren't comparable so they're left out.
+  std::atomic<int64_t> iteration_decode_us{0};
+  std::atomic<size_t> iteration_decode_steps{0};
+  RequestScheduler pending;
+  ConcurrencyLimiter limiter;
+  EngineStats stats;
+  bool iteration_scheduled = false;
+  bool stop = false;
+  std::mutex mtx;
+  std::condition_variable cv;
+};
+}  // namespace oas
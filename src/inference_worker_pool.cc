@@ -0,0 +1,50 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "spdlog/spdlog.h"
+
+#include "inference_worker_pool.h"
+
+namespace oas {
+InferenceWorkerPool::InferenceWorkerPool(size_t num_threads) {
+  spdlog::info("Using [{}] inference threads", num_threads);
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads.emplace_back([this] { Run(); });
+  }
+}
+
+InferenceWorkerPool::~InferenceWorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    shutdown = true;
+  }
+  cv.notify_all();
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+void InferenceWorkerPool::Enqueue(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    tasks.push_back(std::move(task));
+  }
+  cv.notify_one();
+}
+
+void InferenceWorkerPool::Run() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      cv.wait(lock, [this] { return shutdown || !tasks.empty(); });
+      if (shutdown && tasks.empty()) {
+        return;
+      }
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    task();
+  }
+}
+}  // namespace oas
@@ -0,0 +1,36 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace oas {
+// Fixed size pool of compute threads that run the model engines' decode steps.
+// It's separate from the http server's thread pool so that long generations never
+// occupy the threads serving connections and light endpoints like /v1/health.
+class InferenceWorkerPool {
+ public:
+  InferenceWorkerPool(size_t num_threads);
+  ~InferenceWorkerPool();
+  InferenceWorkerPool(const InferenceWorkerPool&) = delete;
+  InferenceWorkerPool& operator=(const InferenceWorkerPool&) = delete;
+
+  void Enqueue(std::function<void()> task);
+  size_t NumThreads() const { return threads.size(); }
+
+ private:
+  void Run();
+
+  std::vector<std::thread> threads;
+  std::deque<std::function<void()>> tasks;
+  bool shutdown = false;
+  std::mutex mtx;
+  std::condition_variable cv;
+};
+}  // namespace oas
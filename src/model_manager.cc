@@ -1,21 +1,108 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // Licensed under the MIT License.
 
+#include <unistd.h>
+
+#include <algorithm>
 #include <fstream>
 #include <mutex>
 #include "model_manager.h"
 
 namespace oas {
+const char* ModelLoadPhaseName(ModelLoadPhase phase) {
+  switch (phase) {
+    case ModelLoadPhase::kCreatingModel:
+      return "creating_model";
+    case ModelLoadPhase::kCreatingTokenizer:
+      return "creating_tokenizer";
+    case ModelLoadPhase::kPreparingTokenizer:
+      return "preparing_tokenizer";
+    case ModelLoadPhase::kStartingEngine:
+      return "starting_engine";
+    case ModelLoadPhase::kLoaded:
+      return "loaded";
+    case ModelLoadPhase::kFailed:
+      return "failed";
+  }
+  return "unknown";
+}
+
 std::vector<std::string> ModelManager::GetLoadedModelsList() {
-  std::lock_guard<std::mutex> lock(model_registry.mtx);
-  const auto& model_runner_registry = model_registry.GetModelRunnerRegistry();
+  auto model_runner_registry = model_registry.GetModelRunnerRegistry();
   std::vector<std::string> ret;
-  for (auto& [model_id, _] : model_runner_registry) {
+  for (auto& [model_id, _] : *model_runner_registry) {
     ret.push_back(model_id);
   }
   return ret;
 }
 
+std::unordered_map<std::string, EngineStats> ModelManager::GetEngineStats() {
+  auto model_runner_registry = model_registry.GetModelRunnerRegistry();
+  std::unordered_map<std::string, EngineStats> ret;
+  for (auto& [model_id, model_runner] : *model_runner_registry) {
+    ret[model_id] = model_runner->engine->GetStats();
+  }
+  return ret;
+}
+
+std::unordered_map<std::string, ResponseCacheStats> ModelManager::GetResponseCacheStats() {
+  auto model_runner_registry = model_registry.GetModelRunnerRegistry();
+  std::unordered_map<std::string, ResponseCacheStats> ret;
+  for (auto& [model_id, model_runner] : *model_runner_registry) {
+    if (model_runner->response_cache) {
+      ret[model_id] = model_runner->response_cache->GetStats();
+    }
+  }
+  return ret;
+}
+
+std::unordered_map<std::string, RequestCoalescerStats> ModelManager::GetRequestCoalescerStats() {
+  auto model_runner_registry = model_registry.GetModelRunnerRegistry();
+  std::unordered_map<std::string, RequestCoalescerStats> ret;
+  for (auto& [model_id, model_runner] : *model_runner_registry) {
+    if (model_runner->request_coalescer) {
+      ret[model_id] = model_runner->request_coalescer->GetStats();
+    }
+  }
+  return ret;
+}
+
+std::unordered_map<std::string, TokenizationCacheStats> ModelManager::GetTokenizationCacheStats() {
+  auto model_runner_registry = model_registry.GetModelRunnerRegistry();
+  std::unordered_map<std::string, TokenizationCacheStats> ret;
+  for (auto& [model_id, model_runner] : *model_runner_registry) {
+    if (model_runner->tokenization_cache) {
+      ret[model_id] = model_runner->tokenization_cache->GetStats();
+    }
+  }
+  return ret;
+}
+
+std::unordered_map<std::string, TokenizerStreamPoolStats> ModelManager::GetTokenizerStreamPoolStats() {
+  auto model_runner_registry = model_registry.GetModelRunnerRegistry();
+  std::unordered_map<std::string, TokenizerStreamPoolStats> ret;
+  for (auto& [model_id, model_runner] : *model_runner_registry) {
+    ret[model_id] = model_runner->tokenizer_streams->GetStats();
+  }
+  return ret;
+}
+
+std::unordered_map<std::string, ModelManager::ModelMemoryStats> ModelManager::GetModelMemoryStats() {
+  auto model_runner_registry = model_registry.GetModelRunnerRegistry();
+  std::unordered_map<std::string, ModelMemoryStats> ret;
+  auto now = std::chrono::steady_clock::now();
+  for (auto& [model_id, model_runner] : *model_runner_registry) {
+    auto& stats = ret[model_id];
+    stats.memory_bytes = model_runner->memory_bytes;
+    stats.pinned = model_runner->pinned;
+    stats.eviction_priority = model_runner->eviction_priority;
+    stats.idle_ttl_secs = model_runner->idle_ttl_secs;
+    auto last_used = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(model_runner->last_used));
+    stats.idle_secs = std::chrono::duration<double>(now - last_used).count();
+  }
+  return ret;
+}
+
 std::vector<std::string> ModelManager::GetModelsFromManifest() {
   std::vector<std::string> ret;
   for (auto& [model_id, _] : model_manifest_registry) {
@@ -24,19 +111,40 @@ std::vector<std::string> ModelManager::GetModelsFromManifest() {
   return ret;
 }
 
-ModelManager::ModelManager(const std::string& downloaded_models_path0)
-    : downloaded_models_path(downloaded_models_path0) {
+ModelManager::ModelManager(const std::string& downloaded_models_path0, const EngineConfig& engine_config0)
+    : engine_config(engine_config0),
+      inference_worker_pool(engine_config0.num_inference_threads),
+      downloaded_models_path(downloaded_models_path0) {
   model_hub_type_downloader_map[ModelSource::kHuggingFace] = DownloadHuggingFaceModel;
   model_hub_type_downloader_map[ModelSource::kLocal] = DownloadLocalModel;
   auto rc = LoadModelsFromDisk(downloaded_models_path0);
   if (rc != Status::kOk) {
     throw OasException("Failed to load models from the disk");
   }
+  reaper = std::thread(&ModelManager::RunIdleReaper, this);
 }
 
-ModelManager::ModelRunner* ModelManager::GetModelRunner(const std::string& model_id) {
-  std::lock_guard<std::mutex> lock(model_registry.mtx);
-  return model_registry.GetModelRunner(model_id);
+ModelManager::~ModelManager() {
+  {
+    std::lock_guard<std::mutex> lock(reaper_mtx);
+    stop_reaper = true;
+  }
+  reaper_cv.notify_all();
+  reaper.join();
+}
+
+std::shared_ptr<ModelManager::ModelRunner> ModelManager::GetModelRunner(const std::string& model_id) {
+  auto model_runner = model_registry.GetModelRunner(model_id);
+  if (!model_runner) {
+    return nullptr;
+  }
+  // pairs with the fence in ClaimForEviction: either the eviction sees this lease or this sees the eviction
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (model_runner->evicting) {
+    return nullptr;
+  }
+  model_runner->last_used = std::chrono::steady_clock::now().time_since_epoch().count();
+  return model_runner;
 }
 
 bool ModelManager::WasModelDownloaded(const std::string& model_id) {
@@ -86,50 +194,386 @@ Status ModelManager::LoadModelsFromDisk(const std::string& downloaded_models_pat
   return Status::kOk;
 }
 
-Status ModelManager::LoadModelImpl(const std::string& model_path, ModelRunner& model_runner) {
+Status ModelManager::LoadModelImpl(const std::string& model_path, ModelRunner& model_runner, std::atomic<ModelLoadPhase>& phase) {
   model_runner.oga_model = OgaModel::Create(model_path.c_str());
   if (!model_runner.oga_model) {
     spdlog::error("could not create model for [{}]", model_path);
     return Status::kFail;
   }
+  phase = ModelLoadPhase::kCreatingTokenizer;
   model_runner.oga_tokenizer = OgaTokenizer::Create(*model_runner.oga_model);
   if (!model_runner.oga_tokenizer) {
     spdlog::error("could not create tokenizer for [{}]", model_path);
     return Status::kFail;
   }
-  model_runner.oga_tokenizer_stream = OgaTokenizerStream::Create(*model_runner.oga_tokenizer);
-  if (!model_runner.oga_tokenizer_stream) {
-    spdlog::error("could not create tokenizer stream for [{}]", model_path);
-    return Status::kFail;
+  // a stream for every request the engine may decode at once; coalesced and cached responses may need more
+  model_runner.tokenizer_streams = std::make_unique<TokenizerStreamPool>(*model_runner.oga_tokenizer,
+                                                                         engine_config.max_batch_size);
+  phase = ModelLoadPhase::kPreparingTokenizer;
+  if (engine_config.token_text_table) {
+    model_runner.token_text_table = TokenTextTable::Create(model_path, *model_runner.oga_tokenizer);
+  }
+  if (engine_config.tokenization_cache_mb) {
+    model_runner.tokenization_cache = std::make_unique<TokenizationCache>(*model_runner.oga_tokenizer,
+                                                                          engine_config.tokenization_cache_mb << 20);
   }
+  phase = ModelLoadPhase::kStartingEngine;
+  auto genai_config = ReadGenAiConfig(model_path);
+  model_runner.engine = std::make_unique<GenerationEngine>(*model_runner.oga_model, engine_config,
+                                                           GetKvCacheSpec(genai_config), inference_worker_pool);
+  if (engine_config.response_cache_mb) {
+    model_runner.response_cache = std::make_unique<ResponseCache>(engine_config.response_cache_mb << 20);
+  }
+  if (engine_config.coalesce_requests) {
+    model_runner.request_coalescer = std::make_unique<RequestCoalescer>();
+  }
+  // a config we couldn't read may well sample, so its responses aren't cached
+  model_runner.samples_by_default = genai_config.is_null() ||
+                                    (ContainsJsonKey(genai_config, "search") &&
+                                     GetJsonValue<bool>(genai_config["search"], "do_sample", false));
   spdlog::info("Model [{}] loaded successfully", model_path);
   return Status::kOk;
 }
 
+json ModelManager::ReadGenAiConfig(const std::string& model_path) {
+  auto config_file = fs::path(model_path) / "genai_config.json";
+  std::ifstream f(config_file);
+  if (!f.good()) {
+    spdlog::warn("Could not read [{}]; KV cache budget won't be enforced", config_file.string());
+    return {};
+  }
+  try {
+    return json::parse(f);
+  } catch (const std::exception& e) {
+    spdlog::warn("Could not parse [{}]: {}; KV cache budget won't be enforced", config_file.string(), e.what());
+    return {};
+  }
+}
+
+KvCacheSpec ModelManager::GetKvCacheSpec(const json& genai_config) {
+  KvCacheSpec spec;
+  if (genai_config.is_null()) {
+    return spec;
+  }
+  try {
+    const auto& model = genai_config.at("model");
+    const auto& decoder = model.at("decoder");
+    auto num_heads = GetJsonValue<size_t>(decoder, "num_attention_heads", 0);
+    spec.num_layers = GetJsonValue<size_t>(decoder, "num_hidden_layers", 0);
+    spec.num_kv_heads = GetJsonValue<size_t>(decoder, "num_key_value_heads", num_heads);
+    spec.head_size = GetJsonValue<size_t>(decoder, "head_size",
+                                          num_heads ? GetJsonValue<size_t>(decoder, "hidden_size", 0) / num_heads : 0);
+    spec.default_max_length = GetJsonValue<size_t>(model, "context_length", 0);
+    if (ContainsJsonKey(genai_config, "search")) {
+      const auto& search = genai_config["search"];
+      spec.default_max_length = GetJsonValue<size_t>(search, "max_length", spec.default_max_length);
+      spec.default_num_beams = std::max<size_t>(1, GetJsonValue<size_t>(search, "num_beams", 1));
+      spec.default_num_return_sequences = std::max<size_t>(1, GetJsonValue<size_t>(search, "num_return_sequences", 1));
+    }
+  } catch (const std::exception& e) {
+    spdlog::warn("genai_config.json doesn't describe the KV cache: {}; KV cache budget won't be enforced", e.what());
+    return KvCacheSpec{};
+  }
+  if (!spec.IsValid()) {
+    spdlog::warn("genai_config.json doesn't describe the KV cache; KV cache budget won't be enforced");
+  }
+  return spec;
+}
+
 void ModelManager::AddModelMetadata(const std::string& model_id, const std::string& model_path) {
   std::lock_guard<std::mutex> lock(model_registry.mtx);
   model_registry.AddModelMetadata(model_id, model_path);
 }
 
-Status ModelManager::LoadModel(const std::string& model_id) {
-  std::lock_guard<std::mutex> lock(model_registry.mtx);
+static std::shared_future<Status> MakeReadyFuture(Status st) {
+  std::promise<Status> promise;
+  promise.set_value(st);
+  return promise.get_future().share();
+}
+
+// The model is loaded without holding the registry's lock, so requests to the models already loaded go on
+// meanwhile. Its files are sized without the lock too.
+std::shared_future<Status> ModelManager::LoadModelAsync(const std::string& model_id) {
+  std::vector<std::shared_ptr<ModelRunner>> evicted;  // freed after the lock is released
+  std::unique_lock<std::mutex> lock(model_registry.mtx);
+  // Returns the future of the model's load if it's loaded or being loaded already.
+  auto find_load = [this, &model_id]() -> std::shared_future<Status> {
+    if (model_registry.GetModelRunner(model_id)) {
+      return MakeReadyFuture(Status::kModelAlreadyLoaded);
+    }
+    auto it = model_loads.find(model_id);
+    if (it != model_loads.end() && it->second->result.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+      return it->second->result;
+    }
+    return {};
+  };
   if (!model_registry.WasModelDownloaded(model_id)) {
     spdlog::error("Model [{}] was not pulled before.", model_id);
-    return Status::kModelNotDownloaded;
+    return MakeReadyFuture(Status::kModelNotDownloaded);
   }
-  if (model_registry.GetModelRunner(model_id)) {
-    return Status::kModelAlreadyLoaded;
+  if (auto result = find_load(); result.valid()) {
+    return result;
   }
-  ModelRunner model_runner;
-  auto rc = LoadModelImpl(model_registry.GetModelPath(model_id), model_runner);
-  if (rc != Status::kOk) {
-    spdlog::error("Loading model [{}] failed", model_id);
-    return rc;
+  auto model_path = model_registry.GetModelPath(model_id);
+  lock.unlock();
+  auto estimated_bytes = EstimateModelBytes(model_path);
+  lock.lock();
+  // another request may have started loading the model meanwhile
+  if (auto result = find_load(); result.valid()) {
+    return result;
+  }
+  if (!MakeRoomFor(estimated_bytes, evicted)) {
+    spdlog::error("Model [{}] needs [{}] MB, which doesn't fit in the memory budget even after evicting the idle models",
+                  model_id, estimated_bytes >> 20);
+    return MakeReadyFuture(Status::kMemoryBudgetExceeded);
+  }
+  // a failed load is replaced; it's over so this doesn't wait
+  auto& load = model_loads[model_id];
+  load = std::make_shared<ModelLoad>();
+  load->start_time = std::chrono::steady_clock::now();
+  load->estimated_bytes = estimated_bytes;
+  // the task doesn't share ownership of the load since the load owns the task's future
+  load->result = std::async(std::launch::async, &ModelManager::RunModelLoad, this, model_id, model_path, std::ref(*load))
+                     .share();
+  return load->result;
+}
+
+size_t ModelManager::EstimateModelBytes(const std::string& model_path) const {
+  size_t ret = engine_config.kv_cache_budget_mb << 20;
+  std::error_code ec;
+  for (fs::recursive_directory_iterator it(model_path, ec), end; !ec && it != end; it.increment(ec)) {
+    if (fs::is_regular_file(it->status())) {
+      ret += fs::file_size(it->path(), ec);
+    }
+  }
+  return ret;
+}
+
+// Marks an idle runner as evicted so that no more leases of it are handed out; returns false and leaves it as
+// is if a lease was taken meanwhile. own_references are the references the caller holds itself.
+static bool ClaimForEviction(const std::shared_ptr<ModelManager::ModelRunner>& model_runner, long own_references) {
+  model_runner->evicting = true;
+  // pairs with the fence in GetModelRunner
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (model_runner.use_count() > own_references) {
+    model_runner->evicting = false;
+    return false;
+  }
+  return true;
+}
+
+bool ModelManager::MakeRoomFor(size_t bytes, std::vector<std::shared_ptr<ModelRunner>>& evicted) {
+  if (!engine_config.model_memory_budget_mb) {
+    return true;
   }
-  model_registry.AddModelRunner(model_id, std::move(model_runner));
+  const size_t budget_bytes = engine_config.model_memory_budget_mb << 20;
+  size_t used_bytes = 0;
+  for (auto& [_, load] : model_loads) {
+    if (load->result.valid() && load->result.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+      used_bytes += load->estimated_bytes;
+    }
+  }
+  // models unloaded while requests held them take up memory until those are done
+  for (auto& [model_runner, memory_bytes] : unloaded_runners) {
+    if (!model_runner.expired()) {
+      used_bytes += memory_bytes;
+    }
+  }
+  auto model_runner_registry = model_registry.GetModelRunnerRegistry();
+  std::vector<std::pair<std::string, std::shared_ptr<ModelRunner>>> candidates;
+  for (auto& [model_id, model_runner] : *model_runner_registry) {
+    used_bytes += model_runner->memory_bytes;
+    // idle if the snapshot holds the only reference; checked again when it's claimed
+    if (!model_runner->pinned && model_runner.use_count() == 1) {
+      candidates.emplace_back(model_id, model_runner);
+    }
+  }
+  if (used_bytes + bytes <= budget_bytes) {
+    return true;
+  }
+  std::sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) {
+    if (a.second->eviction_priority != b.second->eviction_priority) {
+      return a.second->eviction_priority < b.second->eviction_priority;
+    }
+    return a.second->last_used < b.second->last_used;
+  });
+  // a model leased since the snapshot was taken is skipped
+  std::vector<std::pair<std::string, std::shared_ptr<ModelRunner>>> claimed;
+  size_t freed_bytes = 0;
+  for (auto& candidate : candidates) {
+    if (used_bytes - freed_bytes + bytes <= budget_bytes) {
+      break;
+    }
+    // the snapshot and candidates hold a reference each
+    if (ClaimForEviction(candidate.second, 2)) {
+      freed_bytes += candidate.second->memory_bytes;
+      claimed.push_back(std::move(candidate));
+    }
+  }
+  if (used_bytes - freed_bytes + bytes > budget_bytes) {
+    for (auto& [_, model_runner] : claimed) {
+      model_runner->evicting = false;
+    }
+    return false;
+  }
+  model_runner_registry.reset();
+  for (auto& [model_id, model_runner] : claimed) {
+    spdlog::info("Evicting model [{}] to free [{}] MB", model_id, model_runner->memory_bytes >> 20);
+    RemoveLoadedModel(model_id);
+    evicted.push_back(std::move(model_runner));
+  }
+  return true;
+}
+
+std::shared_ptr<ModelManager::ModelRunner> ModelManager::RemoveLoadedModel(const std::string& model_id) {
+  auto model_runner = model_registry.RemoveModelRunner(model_id);
+  if (!model_runner) {
+    return nullptr;
+  }
+  // its load is over since the model was loaded
+  model_loads.erase(model_id);
+  unloaded_runners.erase(std::remove_if(unloaded_runners.begin(), unloaded_runners.end(),
+                                        [](const auto& unloaded) { return unloaded.first.expired(); }),
+                         unloaded_runners.end());
+  unloaded_runners.emplace_back(model_runner, model_runner->memory_bytes);
+  return model_runner;
+}
+
+Status ModelManager::LoadModel(const std::string& model_id) {
+  return LoadModelAsync(model_id).get();
+}
+
+Status ModelManager::UnloadModel(const std::string& model_id) {
+  std::shared_ptr<ModelRunner> model_runner;
+  {
+    std::lock_guard<std::mutex> lock(model_registry.mtx);
+    model_runner = RemoveLoadedModel(model_id);
+    if (!model_runner) {
+      return Status::kModelNotLoaded;
+    }
+  }
+  // snapshots taken before the removal may hold the runner too, but only briefly
+  spdlog::info("Unloaded model [{}]; [{}] references to it are still held by requests in flight", model_id,
+               model_runner.use_count() - 1);
   return Status::kOk;
 }
 
+void ModelManager::RunIdleReaper() {
+  static constexpr auto kReapInterval = std::chrono::seconds(1);
+  std::unique_lock<std::mutex> lock(reaper_mtx);
+  while (!reaper_cv.wait_for(lock, kReapInterval, [this] { return stop_reaper; })) {
+    lock.unlock();
+    UnloadIdleModels();
+    lock.lock();
+  }
+}
+
+void ModelManager::UnloadIdleModels() {
+  std::vector<std::pair<std::string, std::shared_ptr<ModelRunner>>> unloaded;  // freed after the lock is released
+  {
+    std::lock_guard<std::mutex> lock(model_registry.mtx);
+    auto now = std::chrono::steady_clock::now();
+    auto model_runner_registry = model_registry.GetModelRunnerRegistry();
+    for (auto& [model_id, model_runner] : *model_runner_registry) {
+      if (!model_runner->idle_ttl_secs) {
+        continue;
+      }
+      // a model is idle from when its last request finished, not from when it started
+      if (model_runner.use_count() > 1) {
+        model_runner->last_used = now.time_since_epoch().count();
+        continue;
+      }
+      auto last_used = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(model_runner->last_used));
+      // the snapshot holds the only reference
+      if (now - last_used >= std::chrono::seconds(model_runner->idle_ttl_secs) && ClaimForEviction(model_runner, 1)) {
+        unloaded.emplace_back(model_id, model_runner);
+      }
+    }
+    model_runner_registry.reset();
+    for (auto& [model_id, _] : unloaded) {
+      RemoveLoadedModel(model_id);
+    }
+  }
+  for (auto& [model_id, model_runner] : unloaded) {
+    ++num_idle_unloads;
+    spdlog::info("Unloading model [{}] after it was idle for [{}] s", model_id, model_runner->idle_ttl_secs);
+  }
+}
+
+std::unordered_map<std::string, ModelLoadStatus> ModelManager::GetModelLoadStatus() {
+  std::lock_guard<std::mutex> lock(model_registry.mtx);
+  std::unordered_map<std::string, ModelLoadStatus> ret;
+  auto now = std::chrono::steady_clock::now();
+  for (auto& [model_id, load] : model_loads) {
+    auto& status = ret[model_id];
+    status.phase = load->phase;
+    if (status.phase == ModelLoadPhase::kLoaded || status.phase == ModelLoadPhase::kFailed) {
+      status.elapsed_ms = load->elapsed_ms;
+    } else {
+      status.elapsed_ms = std::chrono::duration<double, std::milli>(now - load->start_time).count();
+    }
+  }
+  return ret;
+}
+
+// Returns the resident memory of the process; 0 if it can't be read.
+static size_t GetResidentBytes() {
+  std::ifstream f("/proc/self/statm");
+  size_t total_pages = 0;
+  size_t resident_pages = 0;
+  if (!(f >> total_pages >> resident_pages)) {
+    return 0;
+  }
+  return resident_pages * sysconf(_SC_PAGESIZE);
+}
+
+Status ModelManager::RunModelLoad(const std::string& model_id, const std::string& model_path, ModelLoad& load) {
+  spdlog::info("Loading model [{}]", model_id);
+  auto model_runner = std::make_shared<ModelRunner>();
+  auto load_start = ++num_load_starts;
+  bool ran_alone = ++num_running_loads == 1;
+  auto resident_bytes = GetResidentBytes();
+  Status rc;
+  try {
+    rc = LoadModelImpl(model_path, *model_runner, load.phase);
+  } catch (const std::exception& e) {
+    spdlog::error("Loading model [{}] threw: {}", model_id, e.what());
+    rc = Status::kFail;
+  }
+  auto loaded_resident_bytes = GetResidentBytes();
+  ran_alone &= num_load_starts == load_start;
+  --num_running_loads;
+  if (rc == Status::kOk) {
+    // The growth of resident memory misses weights that are mapped but not touched yet and the KV cache the
+    // model will hold, so it only raises the estimate. Loads running alongside would add theirs to it, so it's
+    // only taken into account if there were none.
+    auto loaded_bytes = ran_alone && loaded_resident_bytes > resident_bytes ? loaded_resident_bytes - resident_bytes : 0;
+    model_runner->memory_bytes = std::max(load.estimated_bytes, loaded_bytes + (engine_config.kv_cache_budget_mb << 20));
+    model_runner->last_used = std::chrono::steady_clock::now().time_since_epoch().count();
+    model_runner->idle_ttl_secs = engine_config.model_idle_ttl_secs;
+    auto manifest_it = model_manifest_registry.find(model_id);
+    if (manifest_it != model_manifest_registry.end()) {
+      model_runner->pinned = manifest_it->second.pinned;
+      model_runner->eviction_priority = manifest_it->second.eviction_priority;
+      if (manifest_it->second.idle_ttl_secs >= 0) {
+        model_runner->idle_ttl_secs = manifest_it->second.idle_ttl_secs;
+      }
+    }
+    spdlog::info("Model [{}] takes up [{}] MB", model_id, model_runner->memory_bytes >> 20);
+  } else {
+    spdlog::error("Loading model [{}] failed", model_id);
+  }
+  std::lock_guard<std::mutex> lock(model_registry.mtx);
+  // Once the model is published it can be unloaded, which destroys the load without waiting for this task, so
+  // the load is finished first.
+  load.elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - load.start_time).count();
+  load.phase = rc == Status::kOk ? ModelLoadPhase::kLoaded : ModelLoadPhase::kFailed;
+  if (rc == Status::kOk) {
+    model_registry.AddModelRunner(model_id, std::move(model_runner));
+  }
+  return rc;
+}
+
 Status ModelManager::InitializeModelManifestRegistry(const std::string& mf_file) {
   spdlog::info("Reading manifest file [{}]", mf_file);
   std::ifstream f(mf_file);
@@ -150,6 +594,9 @@ Status ModelManager::InitializeModelManifestRegistry(const std::string& mf_file)
       mf.model_source = ModelSource::kLocal;
     }
     mf.include_filter = ContainsJsonKey(model, "include_filter") ? model["include_filter"].get<std::string>() : "";
+    mf.pinned = GetJsonValue<bool>(model, "pinned", false);
+    mf.eviction_priority = GetJsonValue<int>(model, "eviction_priority", 0);
+    mf.idle_ttl_secs = GetJsonValue<int64_t>(model, "idle_ttl_secs", -1);
     model_manifest_registry[mf.model_id] = mf;
   }
   spdlog::info("Read manifest for [{}] models", model_manifest_registry.size());
@@ -3,7 +3,13 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <memory>
 #include <string>
+#include <thread>
 #include "spdlog/spdlog.h"
 #include <json.hpp>
 #include "utils.h"
@@ -11,38 +17,124 @@
 
 #include "ort_genai.h"
 #include "model_downloader.h"
+#include "generation_engine.h"
+#include "request_coalescer.h"
+#include "response_cache.h"
+#include "tokenization_cache.h"
+#include "token_text_table.h"
+#include "tokenizer_stream_pool.h"
 
 using json = nlohmann::json;
 namespace fs = std::experimental::filesystem;
 
 namespace oas {
+enum class ModelLoadPhase {
+  kCreatingModel,
+  kCreatingTokenizer,
+  kPreparingTokenizer,  // token text table and tokenization cache
+  kStartingEngine,
+  kLoaded,
+  kFailed
+};
+const char* ModelLoadPhaseName(ModelLoadPhase phase);
+
+struct ModelLoadStatus {
+  ModelLoadPhase phase = ModelLoadPhase::kCreatingModel;
+  double elapsed_ms = 0;  // so far, or in total once the load is over
+};
+
 class ModelManager {
  public:
-  ModelManager(const std::string& downloaded_models_path0);
+  ModelManager(const std::string& downloaded_models_path0, const EngineConfig& engine_config0);
+  ~ModelManager();
+  ModelManager(const ModelManager&) = delete;
+  ModelManager& operator=(const ModelManager&) = delete;
   struct ModelRunner {
     std::unique_ptr<OgaModel> oga_model;
     std::unique_ptr<OgaTokenizer> oga_tokenizer;
-    std::unique_ptr<OgaTokenizerStream> oga_tokenizer_stream;
+    std::unique_ptr<TokenizerStreamPool> tokenizer_streams;  // must be destroyed before oga_tokenizer
+    std::unique_ptr<TokenizationCache> tokenization_cache;  // null if disabled; must be destroyed before oga_tokenizer
+    std::unique_ptr<TokenTextTable> token_text_table;  // null if disabled or the tokenizer isn't supported
+    std::unique_ptr<GenerationEngine> engine;  // must be destroyed before oga_model
+    std::unique_ptr<ResponseCache> response_cache;  // null if response caching is disabled
+    std::unique_ptr<RequestCoalescer> request_coalescer;  // null if coalescing is disabled
+    bool samples_by_default = true;  // the model's search options sample unless a request sets do_sample
+    size_t memory_bytes = 0;  // what the model counts against the memory budget
+    bool pinned = false;  // never evicted to make room for other models
+    int eviction_priority = 0;  // models with lower priorities are evicted first
+    size_t idle_ttl_secs = 0;  // unloaded once it has been idle for this long; 0 means never
+    std::atomic<bool> evicting{false};  // set once the model is claimed for eviction; no more leases are handed out
+    // when the last lease was handed out, or the reaper last saw the model busy
+    std::atomic<std::chrono::steady_clock::rep> last_used{0};
+  };
+  struct ModelMemoryStats {
+    size_t memory_bytes = 0;
+    bool pinned = false;
+    int eviction_priority = 0;
+    size_t idle_ttl_secs = 0;
+    double idle_secs = 0;  // since the last lease was handed out
   };
 
   Status InitializeModelManifestRegistry(const std::string& manifest_file);
   bool WasModelDownloaded(const std::string& model_id);
   std::pair<Status, std::string> DownloadModel(const std::string& model_id);
-  ModelRunner* GetModelRunner(const std::string& model_id);
+  // Returns a lease of the model's runner, null if it isn't loaded. The runner is freed once the model was
+  // unloaded and all of its leases are gone.
+  std::shared_ptr<ModelRunner> GetModelRunner(const std::string& model_id);
+  // Starts loading the model in the background unless it's loaded or being loaded already. Everyone asking
+  // for a model while it loads gets the future of that one load; models load in parallel with each other.
+  std::shared_future<Status> LoadModelAsync(const std::string& model_id);
+  // Waits for the model to be loaded.
   Status LoadModel(const std::string& model_id);
+  // Removes the model from the registry right away; requests holding a lease of it finish normally.
+  Status UnloadModel(const std::string& model_id);
+  // The last load of every model that was loaded, including those in progress.
+  std::unordered_map<std::string, ModelLoadStatus> GetModelLoadStatus();
   void AddModelMetadata(const std::string& model_id, const std::string& model_path);
   std::vector<std::string> GetLoadedModelsList();
+  std::unordered_map<std::string, EngineStats> GetEngineStats();
+  std::unordered_map<std::string, ResponseCacheStats> GetResponseCacheStats();
+  std::unordered_map<std::string, RequestCoalescerStats> GetRequestCoalescerStats();
+  std::unordered_map<std::string, TokenizationCacheStats> GetTokenizationCacheStats();
+  std::unordered_map<std::string, TokenizerStreamPoolStats> GetTokenizerStreamPoolStats();
+  std::unordered_map<std::string, ModelMemoryStats> GetModelMemoryStats();
+  size_t GetNumIdleUnloads() const { return num_idle_unloads; }
   std::vector<std::string> GetModelsFromManifest();
 
  private:
   Status LoadModelsFromDisk(const std::string& downloaded_models_path);
-  Status LoadModelImpl(const std::string& model_path, ModelRunner& model_runner);
+  struct ModelLoad {
+    std::shared_future<Status> result;
+    std::chrono::steady_clock::time_point start_time;
+    std::atomic<ModelLoadPhase> phase{ModelLoadPhase::kCreatingModel};
+    std::atomic<double> elapsed_ms{0};  // set once the load is over
+    size_t estimated_bytes = 0;  // counted against the memory budget until the model is loaded
+  };
+  // Memory a model is expected to take up before it's loaded: its files plus its KV cache budget.
+  size_t EstimateModelBytes(const std::string& model_path) const;
+  // Evicts least recently used idle models that aren't pinned until bytes more fit in the memory budget.
+  // Evicts nothing and returns false if they can't be made to fit. Must be called with model_registry.mtx held;
+  // the evicted runners are handed back so that they're freed after it's released.
+  bool MakeRoomFor(size_t bytes, std::vector<std::shared_ptr<ModelRunner>>& evicted);
+  // Removes the model from the registry; its memory is counted against the budget until its runner is freed.
+  // Must be called with model_registry.mtx held. Returns the removed runner, null if the model wasn't loaded.
+  std::shared_ptr<ModelRunner> RemoveLoadedModel(const std::string& model_id);
+  // Unloads the models that have been idle for longer than their TTL, every kReapInterval until stopped.
+  void RunIdleReaper();
+  void UnloadIdleModels();
+  Status RunModelLoad(const std::string& model_id, const std::string& model_path, ModelLoad& load);
+  Status LoadModelImpl(const std::string& model_path, ModelRunner& model_runner, std::atomic<ModelLoadPhase>& phase);
+  static json ReadGenAiConfig(const std::string& model_path);
+  static KvCacheSpec GetKvCacheSpec(const json& genai_config);
   struct ModelMetadata {
     std::string model_id;
     std::string model_path_on_disk;
   };
+  // The loaded models are published as immutable snapshots of the map of runners, so that finding a model
+  // never waits behind a change of the registry; a change copies the map and swaps the snapshot under mtx.
+  // A runner stays alive as long as a snapshot that has it does.
   struct ModelRegistry {
-    using ModelRunnerRegistry = std::unordered_map<std::string, ModelRunner>;
+    using ModelRunnerRegistry = std::unordered_map<std::string, std::shared_ptr<ModelRunner>>;
     using ModelMetadataRegistry = std::unordered_map<std::string, ModelMetadata>;
 
     bool WasModelDownloaded(const std::string& model_id) const {
@@ -51,24 +143,42 @@ class ModelManager {
     const std::string& GetModelPath(const std::string& model_id) const {
       return model_metadata_registry.at(model_id).model_path_on_disk;
     }
-    void AddModelRunner(const std::string& model_id, ModelRunner&& model_runner) {
-      model_runner_registry[model_id] = std::move(model_runner);
+    // Must be called with mtx held.
+    void AddModelRunner(const std::string& model_id, std::shared_ptr<ModelRunner> model_runner) {
+      auto registry = std::make_shared<ModelRunnerRegistry>(*GetModelRunnerRegistry());
+      (*registry)[model_id] = std::move(model_runner);
+      std::atomic_store(&model_runner_registry, std::shared_ptr<const ModelRunnerRegistry>(std::move(registry)));
+    }
+    // Must be called with mtx held. Returns the removed runner, null if the model wasn't loaded.
+    std::shared_ptr<ModelRunner> RemoveModelRunner(const std::string& model_id) {
+      auto registry = std::make_shared<ModelRunnerRegistry>(*GetModelRunnerRegistry());
+      auto it = registry->find(model_id);
+      if (it == registry->end()) {
+        return nullptr;
+      }
+      auto model_runner = std::move(it->second);
+      registry->erase(it);
+      std::atomic_store(&model_runner_registry, std::shared_ptr<const ModelRunnerRegistry>(std::move(registry)));
+      return model_runner;
     }
     void AddModelMetadata(const std::string& model_id, const std::string& model_path) {
       model_metadata_registry[model_id] = {model_id, model_path};
     }
-    // TODO returns a ptr to an internal member, not good fix it later, should ideally be a const function
-    ModelRunner* GetModelRunner(const std::string& model_id) {
-      if (!model_runner_registry.count(model_id)) return nullptr;
-      return &model_runner_registry.at(model_id);
+    // Doesn't need mtx.
+    std::shared_ptr<ModelRunner> GetModelRunner(const std::string& model_id) const {
+      auto registry = GetModelRunnerRegistry();
+      auto it = registry->find(model_id);
+      return it == registry->end() ? nullptr : it->second;
     }
-    const ModelRunnerRegistry& GetModelRunnerRegistry() const {
-      return model_runner_registry;
+    // Doesn't need mtx.
+    std::shared_ptr<const ModelRunnerRegistry> GetModelRunnerRegistry() const {
+      return std::atomic_load(&model_runner_registry);
     }
 
-    ModelRunnerRegistry model_runner_registry;      // stores data about the models loaded in memory
+    // stores data about the models loaded in memory; read and replaced atomically
+    std::shared_ptr<const ModelRunnerRegistry> model_runner_registry = std::make_shared<const ModelRunnerRegistry>();
     ModelMetadataRegistry model_metadata_registry;  // stores data about the models pulled/downloaded
-    std::mutex mtx;
+    std::mutex mtx;  // guards model_metadata_registry and serializes changes of model_runner_registry
   };
 
   enum class ModelSource {
@@ -81,11 +191,30 @@ class ModelManager {
     std::string include_filter;
     std::string base_path;
     ModelSource model_source = ModelSource::kUnknown;
+    bool pinned = false;  // never evicted to make room for other models
+    int eviction_priority = 0;  // models with lower priorities are evicted first
+    int64_t idle_ttl_secs = -1;  // overrides the server's model_idle_ttl_secs unless negative
   };
   std::unordered_map<ModelSource, ModelDownloader> model_hub_type_downloader_map;
+  EngineConfig engine_config;
+  InferenceWorkerPool inference_worker_pool;  // must outlive the engines in model_registry
   using ModelManifestRegistry = std::unordered_map<std::string, ModelManifest>;
   ModelManifestRegistry model_manifest_registry;
   ModelRegistry model_registry;
+  // guarded by model_registry.mtx; destroying a load waits for it to finish, so it must be destroyed before
+  // model_registry
+  std::unordered_map<std::string, std::shared_ptr<ModelLoad>> model_loads;
+  // runners removed from the registry that requests may still hold, with their memory; guarded by
+  // model_registry.mtx
+  std::vector<std::pair<std::weak_ptr<ModelRunner>, size_t>> unloaded_runners;
+  // the growth of resident memory is only put down to a load that ran on its own
+  std::atomic<size_t> num_load_starts{0};
+  std::atomic<size_t> num_running_loads{0};
   std::string downloaded_models_path;
+  std::atomic<size_t> num_idle_unloads{0};
+  bool stop_reaper = false;
+  std::mutex reaper_mtx;
+  std::condition_variable reaper_cv;
+  std::thread reaper;  // started last, stopped before anything else is destroyed
 };
 }  // namespace oas
\ No newline at end of file
@@ -12,146 +12,533 @@
 #include "json.hpp"
 #include "spdlog/spdlog.h"
 #include "utils.h"
+#include "compression.h"
 #include "model_manager.h"
 
 using json = nlohmann::json;
 namespace fs = std::experimental::filesystem;
 
+// How often a non-streaming request checks whether its client is still connected.
+constexpr std::chrono::milliseconds kClientCheckInterval{100};
+// Longer request timeouts are cut down to this (about 11 days) so the deadline doesn't overflow.
+constexpr double kMaxRequestTimeoutSecs = 1e6;
+
+// When a stream writes the events of its buffered tokens. Every write is a chunk of its own and usually a
+// syscall and TCP segment, so clients reading a lot of tokens may prefer fewer, larger writes.
+// The first token is always written right away so the time to first token doesn't suffer, and every token is
+// written right away if none of the limits are set.
+struct StreamFlushPolicy {
+  size_t max_tokens = 0;    // write once this many tokens are buffered; 0 means no limit
+  size_t max_delay_ms = 0;  // write tokens that have been buffered for this long; 0 means no limit
+  bool adaptive = false;    // write whenever the stream has caught up with the generation, so tokens are
+                            // only batched while writing lags behind (e.g. the socket is backlogged)
+};
+
+// How responses are compressed for clients that accept it (Accept-Encoding: gzip or deflate); off by default.
+// Bodies are compressed if they're large enough, chat completions whenever the client accepts it since their
+// size isn't known when the headers go out, and event streams only if the request opts in with
+// "stream_options": {"compress": true}; events are flushed through the compressor as they're written.
+struct CompressionPolicy {
+  int level = 0;            // zlib compression level (1-9); 0 turns compression off
+  size_t min_bytes = 1024;  // smaller bodies go out uncompressed
+};
+
 struct ServerConfig {
   std::string host = "localhost";
   int port = 8080;
   bool verbose_mode = false;
   int nthreads = 0;
+  size_t max_queued_connections = 0;
+  oas::EngineConfig engine_config;
   std::string model_manifest_file;
   std::string downloaded_models_path = "/tmp/ort_app_server/models";
   std::string cmd_line_model_path;
   std::string cmd_line_model_id;
+  std::vector<std::string> tenant_weights;
+  bool trust_tenant_header = false;  // take the tenant from X-Tenant-Id, e.g. when set by a gateway in front
+  StreamFlushPolicy stream_flush_policy;
+  CompressionPolicy compression;
 };
 
-static void SetSearchOptions(const json& req_data, std::unique_ptr<OgaGeneratorParams>& params) {
-  std::vector<std::string> float_params{"min_length", "max_length", "top_p", "temperature",
-                                        "top_k", "repetition_penalty", "num_beams", "num_return_sequences",
-                                        "length_penalty"};
-  std::vector<std::string> bool_params{"do_sample", "early_stopping"};
+static const std::vector<std::string> kFloatSearchOptions{"min_length", "max_length", "top_p", "temperature",
+                                                          "top_k", "repetition_penalty", "num_beams", "num_return_sequences",
+                                                          "length_penalty"};
+static const std::vector<std::string> kBoolSearchOptions{"do_sample", "early_stopping"};
 
-  for (auto& param : float_params) {
+static void SetSearchOptions(const json& req_data, std::unique_ptr<OgaGeneratorParams>& params) {
+  for (auto& param : kFloatSearchOptions) {
     if (oas::ContainsJsonKey(req_data, param.c_str())) {
       spdlog::debug("setting param [{}]", param);
       params->SetSearchOption(param.c_str(), req_data.value(param, 100 /* this default should not get used */));
     }
   }
 
-  for (auto& param : bool_params) {
+  for (auto& param : kBoolSearchOptions) {
     if (oas::ContainsJsonKey(req_data, param.c_str()))
       params->SetSearchOptionBool(param.c_str(), req_data.value(param, false));
   }
 }
 
-static void HandleNonStreamingChatCompletion(
+// Identifies the response of a deterministic request by its prompt tokens and the search options it sets.
+// Returns an empty key if the request samples.
+static std::string GetDeterministicKey(const json& req_data, const std::vector<int32_t>& prompt_tokens, bool samples_by_default) {
+  if (oas::GetJsonValue<bool>(req_data, "do_sample", samples_by_default)) {
+    return "";
+  }
+  std::ostringstream ostr;
+  for (auto& param : kFloatSearchOptions) {
+    if (oas::ContainsJsonKey(req_data, param)) {
+      ostr << param << '=' << req_data.value(param, 0.0) << ';';
+    }
+  }
+  for (auto& param : kBoolSearchOptions) {
+    if (oas::ContainsJsonKey(req_data, param)) {
+      ostr << param << '=' << req_data.value(param, false) << ';';
+    }
+  }
+  ostr << '\n';
+  ostr.write(reinterpret_cast<const char*>(prompt_tokens.data()), prompt_tokens.size() * sizeof(int32_t));
+  return ostr.str();
+}
+
+// Tokenizes the prompt and prepares the generator params; the model's engine runs the actual generation.
+static std::shared_ptr<oas::GenerationRequest> CreateGenerationRequest(
     const json& req_data,
     const std::string& prompt_str,
-    const std::string& model_id,
-    oas::ModelManager& model_mgr,
-    const httplib::Request& req,
-    httplib::Response& res) {
-  spdlog::debug("Serving non-streaming request");
-  auto sequences = OgaSequences::Create();
-
+    const std::string& tenant,
+    oas::ModelManager::ModelRunner& model_runner) {
   std::string to_search = "<|user|>";
   auto pos = prompt_str.rfind(to_search);
 
-  auto* model_runner = model_mgr.GetModelRunner(model_id);
-  auto& oga_model = model_runner->oga_model;
-  auto& oga_tokenizer = model_runner->oga_tokenizer;
+  auto& oga_model = model_runner.oga_model;
+  auto& oga_tokenizer = model_runner.oga_tokenizer;
 
-  if (pos != std::string::npos) {
-    auto prompt_str_new = prompt_str.substr(pos);
-    oga_tokenizer->Encode(prompt_str_new.c_str(), *sequences);
+  std::vector<int32_t> prompt_tokens;
+  auto prompt_str_new = pos != std::string::npos ? prompt_str.substr(pos) : prompt_str;
+  if (model_runner.tokenization_cache) {
+    prompt_tokens = model_runner.tokenization_cache->Encode(prompt_str_new);
   } else {
-    oga_tokenizer->Encode(prompt_str.c_str(), *sequences);
+    auto sequences = OgaSequences::Create();
+    oga_tokenizer->Encode(prompt_str_new.c_str(), *sequences);
+    prompt_tokens.assign(sequences->SequenceData(0), sequences->SequenceData(0) + sequences->SequenceCount(0));
   }
+
   auto params = OgaGeneratorParams::Create(*oga_model);
   SetSearchOptions(req_data, params);
-  params->SetInputSequences(*sequences);
-  auto output_sequences = oga_model->Generate(*params);
-  auto out_string = oga_tokenizer->Decode(output_sequences->SequenceData(0), output_sequences->SequenceCount(0));
-  json json_res = oas::FormatNonStreamingChatResponse(static_cast<const char*>(out_string));
-  const std::string response = json_res.dump(-1, ' ', false, json::error_handler_t::replace);
-  res.set_content(response, "application/json; charset=utf-8");
+  std::string deterministic_key;
+  if (model_runner.response_cache || model_runner.request_coalescer) {
+    deterministic_key = GetDeterministicKey(req_data, prompt_tokens, model_runner.samples_by_default);
+  }
+  auto request = std::make_shared<oas::GenerationRequest>(std::move(prompt_tokens), std::move(params));
+  request->max_length = oas::GetJsonValue<size_t>(req_data, "max_length", 0);
+  request->tenant = tenant;
+  request->num_beams = oas::GetJsonValue<size_t>(req_data, "num_beams", 0);
+  request->num_return_sequences = oas::GetJsonValue<size_t>(req_data, "num_return_sequences", 0);
+  request->deterministic_key = std::move(deterministic_key);
+  return request;
 }
 
-static void HandleStreamingChatCompletion(
-    const json& req_data,
-    const std::string& prompt_str,
-    const std::string& model_id,
-    oas::ModelManager& model_mgr,
+// Submits the request to the model's engine and waits until it joins the running batch.
+// Returns false after setting the response if the request was shed or its client went away meanwhile.
+static bool AdmitGenerationRequest(
+    oas::GenerationEngine& engine,
+    const std::shared_ptr<oas::GenerationRequest>& request,
     const httplib::Request& req,
+    httplib::Response& res,
+    const std::function<bool()>& release = nullptr) {
+  auto st = engine.Submit(request);
+  if (st == oas::Status::kOk) {
+    st = engine.WaitForAdmission(*request, req.is_connection_closed, release);
+  }
+  switch (st) {
+    case oas::Status::kOk:
+      return true;
+    case oas::Status::kCancelled: {
+      spdlog::info("Client disconnected while its request was queued");
+      res.status = 500;
+      res.set_content("Client disconnected", "application/text");
+      return false;
+    }
+    case oas::Status::kDeadlineExceeded: {
+      res.status = 504;
+      res.set_content("Request deadline exceeded while waiting for the model", "application/text");
+      return false;
+    }
+    case oas::Status::kKvCacheBudgetExceeded: {
+      res.status = 400;
+      res.set_content("Request needs more KV cache memory than the model's budget; lower 'max_length' or 'num_beams'", "application/text");
+      return false;
+    }
+    case oas::Status::kQueueFull:
+    case oas::Status::kQueueTimeout: {
+      res.status = 429;
+      res.set_header("Retry-After", std::to_string(engine.EstimateRetryAfterSecs()));
+      res.set_content(st == oas::Status::kQueueFull ? "Too many requests queued for the model"
+                                                    : "Timed out waiting for the model",
+                      "application/text");
+      return false;
+    }
+    default: {
+      res.status = 500;
+      res.set_content("Failed to schedule request. Error: " + request->GetError(), "application/text");
+      return false;
+    }
+  }
+}
+
+// Keeps the response of a deterministic request that ran to completion for identical requests.
+static void CacheResponse(
+    const oas::GenerationRequest& request,
+    const std::vector<int32_t>& output_tokens,
+    oas::ModelManager::ModelRunner& model_runner) {
+  if (!model_runner.response_cache || request.deterministic_key.empty() || request.IsDeadlineExceeded()) {
+    return;
+  }
+  model_runner.response_cache->Put(request.deterministic_key, output_tokens);
+}
+
+// Returns the encoding the client accepts for its response; identity if compression is off.
+static oas::ContentEncoding GetResponseEncoding(const CompressionPolicy& policy, const httplib::Request& req) {
+  if (!policy.level || !req.has_header("Accept-Encoding")) {
+    return oas::ContentEncoding::kIdentity;
+  }
+  return oas::NegotiateContentEncoding(req.get_header_value("Accept-Encoding"));
+}
+
+static void SetContentEncoding(oas::ContentEncoding encoding, httplib::Response& res) {
+  res.set_header("Content-Encoding", oas::GetContentEncodingName(encoding));
+  res.set_header("Vary", "Accept-Encoding");
+}
+
+// Compresses the body of res; it's sent as is if that fails.
+static void CompressBody(oas::ContentEncoding encoding, int level, httplib::Response& res) {
+  std::string compressed;
+  if (!oas::Compressor(encoding, level).Compress(res.body, true, compressed)) {
+    spdlog::error("Failed to compress a response with [{}]", oas::GetContentEncodingName(encoding));
+    return;
+  }
+  res.body.swap(compressed);
+  if (res.has_header("Content-Length")) {
+    // httplib sets it from the body before the post routing handler runs
+    res.headers.erase("Content-Length");
+    res.set_header("Content-Length", std::to_string(res.body.size()));
+  }
+  SetContentEncoding(encoding, res);
+}
+
+// Compresses the bodies of textual responses that are large enough; runs after every handler.
+static void CompressResponse(const CompressionPolicy& policy, const httplib::Request& req, httplib::Response& res) {
+  if (res.body.empty() || res.body.size() < policy.min_bytes || res.has_header("Content-Encoding") ||
+      res.has_header("Content-Range")) {
+    return;
+  }
+  auto content_type = res.get_header_value("Content-Type");
+  if (content_type.rfind("application/json", 0) && content_type.rfind("application/text", 0) &&
+      (content_type.rfind("text/", 0) || !content_type.rfind("text/event-stream", 0))) {
+    // event streams are compressed by their handler if the request opts in
+    return;
+  }
+  auto encoding = GetResponseEncoding(policy, req);
+  if (encoding != oas::ContentEncoding::kIdentity) {
+    CompressBody(encoding, policy.level, res);
+  }
+}
+
+// Replays a response from the model's response cache without admitting the request to the engine.
+static void ServeCachedResponse(
+    const std::vector<int32_t>& output_tokens,
+    const std::shared_ptr<oas::ModelManager::ModelRunner>& model_runner,
+    bool stream,
     httplib::Response& res) {
-  spdlog::debug("Serving streaming request for model [{}] for prompt [{}]", model_id, prompt_str);
-  auto chunked_content_provider = [&, prompt_str, model_id](size_t, httplib::DataSink& sink) {
-    // spdlog::debug("inside chunked, model_id: [{}], prompt: [{}]", model_id, prompt_str);
-    auto sequences = OgaSequences::Create();
+  spdlog::debug("Serving {} request from the response cache", stream ? "streaming" : "non-streaming");
+  res.status = 200;
+  if (!stream) {
+    auto out_string = model_runner->oga_tokenizer->Decode(output_tokens.data(), output_tokens.size());
+    res.set_content(oas::FormatNonStreamingChatResponse(static_cast<const char*>(out_string)), "application/json; charset=utf-8");
+    return;
+  }
+  std::string body;
+  if (model_runner->token_text_table) {
+    oas::TokenTextDecoder decoder(*model_runner->token_text_table, *model_runner->oga_tokenizer);
+    for (auto token : output_tokens) {
+      oas::AppendStreamingChatResponse(body, decoder.Decode(token), false);
+    }
+  } else {
+    auto tokenizer_stream = model_runner->tokenizer_streams->Acquire();
+    for (auto token : output_tokens) {
+      oas::AppendStreamingChatResponse(body, tokenizer_stream->Decode(token), false);
+    }
+  }
+  oas::AppendStreamingChatResponse(body, "", true);
+  res.set_content(body, "text/event-stream");
+}
 
-    std::string to_search = "<|user|>";
-    if (prompt_str.empty()) {
-      spdlog::debug("prompt is empty inside chunked_content_provider");
-      return false;
+// Lets go of a generation when its client is gone; a shared one keeps running for as long as others read it.
+// Must be called once per subscriber that didn't receive its whole response.
+static void UnsubscribeFromGeneration(
+    oas::GenerationRequest& generation,
+    const std::shared_ptr<oas::ModelManager::ModelRunner>& model_runner,
+    bool shared) {
+  if (!shared || model_runner->request_coalescer->Unsubscribe(generation)) {
+    generation.Cancel();
+  }
+}
+
+// Returns the generation that serves the request: an identical request's generation already in flight
+// or, after admitting it to the engine, the request itself. Returns null after setting the response if
+// the request was shed or its client went away meanwhile. shared is set if the generation is one of the
+// model's request coalescer.
+// Only requests without a deadline of their own are shared since a deadline could cut the response short.
+static std::shared_ptr<oas::GenerationRequest> SubscribeToGeneration(
+    const std::shared_ptr<oas::GenerationRequest>& request,
+    const std::shared_ptr<oas::ModelManager::ModelRunner>& model_runner,
+    const httplib::Request& req,
+    httplib::Response& res,
+    bool& shared) {
+  auto& coalescer = model_runner->request_coalescer;
+  shared = coalescer && !request->deterministic_key.empty() &&
+           request->deadline == std::chrono::steady_clock::time_point::max();
+  if (shared) {
+    auto generation = coalescer->Subscribe(request);
+    if (generation != request) {
+      if (generation->WaitUntilAdmitted(req.is_connection_closed)) {
+        spdlog::debug("Coalesced request with an identical one in flight");
+        return generation;
+      }
+      if (req.is_connection_closed()) {
+        spdlog::info("Client disconnected while the request it shares was queued");
+        UnsubscribeFromGeneration(*generation, model_runner, shared);
+        res.status = 500;
+        res.set_content("Client disconnected", "application/text");
+        return nullptr;
+      }
+      // the generation we'd share was shed; try on our own
+      shared = false;
+    }
+  }
+  // Requests that subscribed meanwhile wait for this one, so if our client goes away or gives up while it's
+  // queued, it only keeps its place in the queue for them.
+  bool released = false;
+  std::function<bool()> release;
+  if (shared) {
+    release = [&coalescer, &request, &released] {
+      released = true;
+      return coalescer->Unsubscribe(*request);
+    };
+  }
+  if (!AdmitGenerationRequest(*model_runner->engine, request, req, res, release)) {
+    if (shared && !released) {
+      coalescer->Remove(*request);
+      request->Abandon("Request was shed before it ran");
     }
-    auto pos = prompt_str.rfind(to_search);
+    return nullptr;
+  }
+  return request;
+}
+
 
-    auto* model_runner = model_mgr.GetModelRunner(model_id);
-    auto& oga_model = model_runner->oga_model;
-    auto& oga_tokenizer = model_runner->oga_tokenizer;
-    auto& oga_tokenizer_stream = model_runner->oga_tokenizer_stream;
+static void HandleNonStreamingChatCompletion(
+    const std::shared_ptr<oas::GenerationRequest>& request,
+    const std::shared_ptr<oas::ModelManager::ModelRunner>& model_runner,
+    oas::ContentEncoding encoding,
+    int compression_level,
+    const httplib::Request& req,
+    httplib::Response& res) {
+  spdlog::debug("Serving non-streaming request");
+  bool shared = false;
+  auto generation = SubscribeToGeneration(request, model_runner, req, res, shared);
+  if (!generation) {
+    return;
+  }
+  if (encoding != oas::ContentEncoding::kIdentity) {
+    SetContentEncoding(encoding, res);
+  }
 
-    if (pos != std::string::npos) {
-      auto prompt_str_new = prompt_str.substr(pos);
-      oga_tokenizer->Encode(prompt_str_new.c_str(), *sequences);
-    } else {
-      oga_tokenizer->Encode(prompt_str.c_str(), *sequences);
+  // The response is produced by a content provider so that the wait can poll the connection
+  // and stop generating as soon as the client goes away.
+  auto content_provider = [request, generation, model_runner, encoding, compression_level](size_t, httplib::DataSink& sink) {
+    while (!generation->WaitForCompletion(kClientCheckInterval)) {
+      if (!sink.is_writable()) {
+        // on_complete lets go of the generation
+        spdlog::info("Client disconnected; cancelling its request");
+        return false;
+      }
+    }
+    if (model_runner->request_coalescer) {
+      model_runner->request_coalescer->Remove(*generation);
     }
-    auto params = OgaGeneratorParams::Create(*oga_model);
-    if (!params) {
-      spdlog::debug("nullptr params");
+    std::vector<int32_t> output_tokens;
+    int32_t new_token;
+    while (generation->GetToken(output_tokens.size(), new_token)) {
+      output_tokens.push_back(new_token);
+    }
+    auto err = generation->GetError();
+    if (generation->IsDeadlineExceeded()) {
+      spdlog::info("Returning partial response since the request ran past its deadline");
+    } else if (!err.empty()) {
+      spdlog::error("Non-streaming generation failed: {}", err);
+      return false;
+    } else if (generation->IsCancelled()) {
       return false;
     }
-    SetSearchOptions(req_data, params);
-    params->SetInputSequences(*sequences);
-    auto generator = OgaGenerator::Create(*oga_model, *params);
-    if (!generator) {
-      spdlog::debug("nullptr generator");
+    if (generation == request) {
+      CacheResponse(*request, output_tokens, *model_runner);
+    }
+    auto out_string = model_runner->oga_tokenizer->Decode(output_tokens.data(), output_tokens.size());
+    std::string response = oas::FormatNonStreamingChatResponse(static_cast<const char*>(out_string));
+    if (encoding != oas::ContentEncoding::kIdentity) {
+      std::string compressed;
+      if (!oas::Compressor(encoding, compression_level).Compress(response, true, compressed)) {
+        spdlog::error("Failed to compress a response with [{}]", oas::GetContentEncodingName(encoding));
+        return false;
+      }
+      response.swap(compressed);
+    }
+    if (!sink.write(response.c_str(), response.size())) {
+      spdlog::info("Failed to write to the sink (probably because the client severed the connection)");
       return false;
     }
-    while (!generator->IsDone()) {
-      generator->ComputeLogits();
-      generator->GenerateNextToken();
-
-      const auto num_tokens = generator->GetSequenceCount(0);
-      const auto new_token = generator->GetSequenceData(0)[num_tokens - 1];
-      const auto decode_c_str = oga_tokenizer_stream->Decode(new_token);
-      // spdlog::debug("after decode, before format...");
-      json json_res = oas::FormatStreamingChatResponse(decode_c_str, false);
-      const std::string str = "data: " + json_res.dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n";
-      // spdlog::debug("Writing to stream [{}]", str);
-      if (!sink.write(str.c_str(), str.size())) {
+    sink.done();
+    return true;
+  };
+
+  auto on_complete = [generation, model_runner, shared](bool success) {
+    if (!success) {
+      UnsubscribeFromGeneration(*generation, model_runner, shared);
+    }
+  };
+
+  res.set_chunked_content_provider("application/json; charset=utf-8", content_provider, on_complete);
+}
+
+// Returns the time until which a stream may wait for its next token before writing the buffered ones.
+static std::chrono::steady_clock::time_point GetFlushDeadline(
+    const StreamFlushPolicy& flush_policy,
+    std::chrono::steady_clock::time_point first_buffered_time) {
+  if (flush_policy.adaptive) {
+    return first_buffered_time;  // don't wait; write unless the next token is already there
+  }
+  if (flush_policy.max_delay_ms) {
+    return first_buffered_time + std::chrono::milliseconds(flush_policy.max_delay_ms);
+  }
+  return std::chrono::steady_clock::time_point::max();
+}
+
+static void HandleStreamingChatCompletion(
+    const std::shared_ptr<oas::GenerationRequest>& request,
+    const std::shared_ptr<oas::ModelManager::ModelRunner>& model_runner,
+    const StreamFlushPolicy& flush_policy,
+    oas::ContentEncoding encoding,
+    int compression_level,
+    const httplib::Request& req,
+    httplib::Response& res) {
+  spdlog::debug("Serving streaming request");
+  bool shared = false;
+  auto generation = SubscribeToGeneration(request, model_runner, req, res, shared);
+  if (!generation) {
+    return;
+  }
+  if (encoding != oas::ContentEncoding::kIdentity) {
+    SetContentEncoding(encoding, res);
+  }
+
+  auto chunked_content_provider = [request, generation, model_runner, flush_policy, encoding,
+                                   compression_level](size_t, httplib::DataSink& sink) {
+    oas::TokenizerStreamPool::Lease tokenizer_stream;  // taken at the first token so queued requests don't hold one
+    std::unique_ptr<oas::TokenTextDecoder> token_decoder;
+    if (model_runner->token_text_table) {
+      token_decoder = std::make_unique<oas::TokenTextDecoder>(*model_runner->token_text_table, *model_runner->oga_tokenizer);
+    }
+    std::vector<int32_t> output_tokens;
+    std::string events;  // events not written yet; reused for the whole stream so it doesn't allocate per token
+    size_t num_buffered = 0;
+    std::chrono::steady_clock::time_point first_buffered_time;
+    std::unique_ptr<oas::Compressor> compressor;
+    std::string compressed;
+    if (encoding != oas::ContentEncoding::kIdentity) {
+      compressor = std::make_unique<oas::Compressor>(encoding, compression_level);
+    }
+    // the last write ends the compressed stream
+    auto flush = [&sink, &events, &num_buffered, &compressor, &compressed](bool last = false) {
+      num_buffered = 0;
+      // spdlog::debug("Writing to stream [{}]", events);
+      if (compressor) {
+        compressed.clear();
+        if (!compressor->Compress(events, last, compressed)) {
+          spdlog::error("Failed to compress a stream");
+          return false;
+        }
+        events.swap(compressed);
+      }
+      bool ok = sink.write(events.data(), events.size());
+      events.clear();
+      if (!ok) {
         spdlog::info("Failed to write to the sink (probably because the client severed the connection)");
-        return false;
       }
+      return ok;
+    };
+    const bool has_limit = flush_policy.max_tokens || flush_policy.max_delay_ms || flush_policy.adaptive;
+    int32_t new_token;
+    while (true) {
+      if (num_buffered) {
+        auto flush_deadline = GetFlushDeadline(flush_policy, first_buffered_time);
+        if (flush_deadline != std::chrono::steady_clock::time_point::max() &&
+            !generation->WaitForToken(output_tokens.size(), flush_deadline) && !flush()) {
+          return false;
+        }
+      }
+      if (!generation->GetToken(output_tokens.size(), new_token)) {
+        break;
+      }
+      output_tokens.push_back(new_token);
+      if (!token_decoder && !tokenizer_stream) {
+        tokenizer_stream = model_runner->tokenizer_streams->Acquire();
+      }
+      const auto decode_c_str = token_decoder ? token_decoder->Decode(new_token) : tokenizer_stream->Decode(new_token);
+      auto now = std::chrono::steady_clock::now();
+      if (!num_buffered) {
+        first_buffered_time = now;
+      }
+      oas::AppendStreamingChatResponse(events, decode_c_str, false);
+      ++num_buffered;
+      if (output_tokens.size() == 1 || !has_limit ||
+          (flush_policy.max_tokens && num_buffered >= flush_policy.max_tokens) ||
+          (flush_policy.max_delay_ms && now - first_buffered_time >= std::chrono::milliseconds(flush_policy.max_delay_ms))) {
+        if (!flush()) {
+          return false;
+        }
+      }
+    }
+    if (model_runner->request_coalescer) {
+      model_runner->request_coalescer->Remove(*generation);
+    }
+    auto err = generation->GetError();
+    if (generation->IsDeadlineExceeded()) {
+      spdlog::info("Ending stream early since the request ran past its deadline");
+    } else if (!err.empty()) {
+      spdlog::error("Streaming generation failed: {}", err);
+      return false;
+    } else if (generation->IsCancelled()) {
+      return false;
+    }
+    if (generation == request) {
+      CacheResponse(*request, output_tokens, *model_runner);
     }
 
-    json json_res = oas::FormatStreamingChatResponse("", true);
-    const std::string str = "data: " + json_res.dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n";
-    // spdlog::debug("Writing to stream [{}]", str);
-    if (!sink.write(str.c_str(), str.size())) {
-      spdlog::info("Failed to write to the sink (probably because the client severed the connection)");
+    // the last tokens go out together with the final event
+    oas::AppendStreamingChatResponse(events, "", true);
+    if (!flush(true)) {
       return false;
     }
     sink.done();
     return true;
   };
 
-  auto on_complete = [](bool) {
-    // cancel
+  auto on_complete = [generation, model_runner, shared](bool success) {
+    // cancel generation that's still running if the response didn't complete
+    if (!success) {
+      UnsubscribeFromGeneration(*generation, model_runner, shared);
+    }
     spdlog::debug("On_complete finished");
   };
 
@@ -163,7 +550,81 @@ static void SetBadRequest(httplib::Response& res, const std::string& msg) {
   res.set_content(msg, "application/text");
 }
 
-static void HandleChatCompletions(oas::ModelManager& model_mgr, const httplib::Request& req, httplib::Response& res) {
+// Returns the tenant of the request used for fair sharing: the X-Tenant-Id header if the server trusts it, or
+// else one derived from the API key if there's one; untrusted clients could pick a fresh tenant for every
+// request.
+static std::string GetTenant(const httplib::Request& req, bool trust_tenant_header) {
+  if (trust_tenant_header && req.has_header("X-Tenant-Id")) {
+    return req.get_header_value("X-Tenant-Id");
+  }
+  auto api_key = httplib::get_bearer_token_auth(req);
+  if (api_key.empty()) {
+    return oas::kDefaultTenant;
+  }
+  // don't keep the key itself around since tenants are listed in /v1/ps
+  std::ostringstream ostr;
+  ostr << "key-" << std::hex << std::hash<std::string>{}(api_key);
+  return ostr.str();
+}
+
+// Reads the request's scheduling class from the X-Priority header or the 'priority' key.
+// Streaming requests default to interactive and non-streaming ones to batch.
+// 'timeout' (or 'max_time') sets the request's deadline in seconds.
+static bool SetSchedulingOptions(
+    const json& req_data,
+    const httplib::Request& req,
+    bool stream,
+    oas::GenerationRequest& request,
+    httplib::Response& res) {
+  auto priority_str = req.has_header("X-Priority") ? req.get_header_value("X-Priority")
+                                                   : oas::GetJsonValue<std::string>(req_data, "priority", "");
+  if (priority_str.empty()) {
+    request.priority = stream ? oas::RequestPriority::kInteractive : oas::RequestPriority::kBatch;
+  } else if (!oas::ParseRequestPriority(priority_str, request.priority)) {
+    SetBadRequest(res, "Invalid priority [" + priority_str + "]; expected 'interactive' or 'batch'");
+    return false;
+  }
+  auto timeout_secs = oas::GetJsonValue<double>(req_data, "timeout", oas::GetJsonValue<double>(req_data, "max_time", 0));
+  if (timeout_secs < 0) {
+    SetBadRequest(res, "'timeout' must not be negative");
+    return false;
+  }
+  if (timeout_secs > 0) {
+    auto timeout = std::chrono::duration<double>(std::min(timeout_secs, kMaxRequestTimeoutSecs));
+    request.deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+  }
+  return true;
+}
+
+// Reads how the stream writes its tokens from 'stream_options' ('flush_tokens', 'flush_interval_ms' and
+// 'adaptive_flush'), falling back to the server's policy.
+static bool GetStreamFlushPolicy(
+    const json& req_data,
+    const StreamFlushPolicy& server_policy,
+    StreamFlushPolicy& flush_policy,
+    httplib::Response& res) {
+  flush_policy = server_policy;
+  if (!oas::ContainsJsonKey(req_data, "stream_options")) {
+    return true;
+  }
+  const auto& stream_options = req_data["stream_options"];
+  if (!stream_options.is_object()) {
+    SetBadRequest(res, "'stream_options' must be an object");
+    return false;
+  }
+  auto max_tokens = oas::GetJsonValue<int64_t>(stream_options, "flush_tokens", flush_policy.max_tokens);
+  auto max_delay_ms = oas::GetJsonValue<int64_t>(stream_options, "flush_interval_ms", flush_policy.max_delay_ms);
+  if (max_tokens < 0 || max_delay_ms < 0) {
+    SetBadRequest(res, "'flush_tokens' and 'flush_interval_ms' must not be negative");
+    return false;
+  }
+  flush_policy.max_tokens = max_tokens;
+  flush_policy.max_delay_ms = max_delay_ms;
+  flush_policy.adaptive = oas::GetJsonValue<bool>(stream_options, "adaptive_flush", flush_policy.adaptive);
+  return true;
+}
+
+static void HandleChatCompletions(oas::ModelManager& model_mgr, const ServerConfig& svr_config, const httplib::Request& req, httplib::Response& res) {
   res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
   json req_data = json::parse(req.body);
 
@@ -178,10 +639,19 @@ static void HandleChatCompletions(oas::ModelManager& model_mgr, const httplib::R
   }
   auto model_id = req_data["model"].get<std::string>();
 
-  if (!model_mgr.GetModelRunner(model_id)) {
-    spdlog::info("Model [{}] was not loaded before. Attempting to load the model first.", model_id);
+  for (auto param : {"max_length", "num_beams", "num_return_sequences"}) {
+    if (oas::ContainsJsonKey(req_data, param) && !req_data[param].is_number_unsigned()) {
+      SetBadRequest(res, std::string("'") + param + "' must be a non-negative integer");
+      return;
+    }
+  }
+
+  // the lease keeps the model in memory until the response is done, even if it's unloaded meanwhile
+  auto model_runner = model_mgr.GetModelRunner(model_id);
+  if (!model_runner) {
+    spdlog::info("Model [{}] was not loaded before. Waiting for it to load.", model_id);
     auto st = model_mgr.LoadModel(model_id);
-    if (st != oas::Status::kOk) {
+    if (st != oas::Status::kOk && st != oas::Status::kModelAlreadyLoaded) {
       switch (st) {
         case oas::Status::kFail: {
           res.status = 500;
@@ -193,9 +663,20 @@ static void HandleChatCompletions(oas::ModelManager& model_mgr, const httplib::R
           res.set_content("Model was not downloaded before", "application/text");
           break;
         }
+        case oas::Status::kMemoryBudgetExceeded: {
+          res.status = 503;
+          res.set_content("Not enough memory to load the model; the models loaded are busy or pinned", "application/text");
+          break;
+        }
       }
       return;
     }
+    model_runner = model_mgr.GetModelRunner(model_id);
+    if (!model_runner) {
+      res.status = 503;
+      res.set_content("Model was unloaded right after loading", "application/text");
+      return;
+    }
   }
 
   json messages_arr = req_data["messages"];
@@ -213,11 +694,36 @@ static void HandleChatCompletions(oas::ModelManager& model_mgr, const httplib::R
     return;
   }
 
-  spdlog::debug("Received prompt: [{}]", prompt_str);
-  if (oas::GetJsonValue<bool>(req_data, "stream", false)) {
-    HandleStreamingChatCompletion(req_data, prompt_str, model_id, model_mgr, req, res);
+  spdlog::debug("Received prompt: [{}] for model [{}]", prompt_str, model_id);
+  bool stream = oas::GetJsonValue<bool>(req_data, "stream", false);
+  auto tenant = GetTenant(req, svr_config.trust_tenant_header);
+  auto request = CreateGenerationRequest(req_data, prompt_str, tenant, *model_runner);
+  if (!SetSchedulingOptions(req_data, req, stream, *request, res)) {
+    return;
+  }
+  StreamFlushPolicy flush_policy;
+  if (stream && !GetStreamFlushPolicy(req_data, svr_config.stream_flush_policy, flush_policy, res)) {
+    return;
+  }
+  auto encoding = GetResponseEncoding(svr_config.compression, req);
+  if (stream && !(oas::ContainsJsonKey(req_data, "stream_options") &&
+                  oas::GetJsonValue<bool>(req_data["stream_options"], "compress", false))) {
+    encoding = oas::ContentEncoding::kIdentity;
+  }
+  if (model_runner->response_cache && !request->deterministic_key.empty()) {
+    std::vector<int32_t> output_tokens;
+    if (model_runner->response_cache->Get(request->deterministic_key, output_tokens)) {
+      ServeCachedResponse(output_tokens, model_runner, stream, res);
+      if (stream && encoding != oas::ContentEncoding::kIdentity) {
+        CompressBody(encoding, svr_config.compression.level, res);
+      }
+      return;
+    }
+  }
+  if (stream) {
+    HandleStreamingChatCompletion(request, model_runner, flush_policy, encoding, svr_config.compression.level, req, res);
   } else {
-    HandleNonStreamingChatCompletion(req_data, prompt_str, model_id, model_mgr, req, res);
+    HandleNonStreamingChatCompletion(request, model_runner, encoding, svr_config.compression.level, req, res);
   }
 }
 
@@ -228,6 +734,98 @@ static void HandleListLoadedModels(oas::ModelManager& model_mgr, const httplib::
   for (auto& s : models) {
     ret["models"].push_back(s);
   }
+  ret["stats"] = json::object();
+  ret["num_idle_unloads"] = model_mgr.GetNumIdleUnloads();
+  for (auto& [model_id, stats] : model_mgr.GetEngineStats()) {
+    json& model_stats = ret["stats"][model_id];
+    model_stats["active"] = stats.active;
+    model_stats["prefilling"] = stats.prefilling;
+    model_stats["queue_depth"] = stats.queue_depth;
+    model_stats["max_queue_depth"] = stats.max_queue_depth;
+    model_stats["concurrency_limit"] = stats.concurrency_limit;
+    model_stats["avg_step_latency_ms"] = stats.avg_step_latency_ms;
+    model_stats["baseline_step_latency_ms"] = stats.baseline_step_latency_ms;
+    model_stats["num_admitted"] = stats.num_admitted;
+    model_stats["num_completed"] = stats.num_completed;
+    model_stats["num_rejected"] = stats.num_rejected;
+    model_stats["num_queue_timeouts"] = stats.num_queue_timeouts;
+    model_stats["num_cancelled"] = stats.num_cancelled;
+    model_stats["num_deadline_exceeded"] = stats.num_deadline_exceeded;
+    model_stats["avg_queue_wait_ms"] = stats.avg_queue_wait_ms;
+    model_stats["max_queue_wait_ms"] = stats.max_queue_wait_ms;
+    model_stats["avg_service_time_ms"] = stats.avg_service_time_ms;
+    model_stats["num_prefills"] = stats.num_prefills;
+    model_stats["avg_prefill_ms"] = stats.avg_prefill_ms;
+    model_stats["prefill_time_ms"] = stats.prefill_time_ms;
+    model_stats["decode_time_ms"] = stats.decode_time_ms;
+    model_stats["kv_cache_bytes_per_token"] = stats.kv_cache_bytes_per_token;
+    model_stats["kv_cache_bytes_in_use"] = stats.kv_cache_bytes_in_use;
+    model_stats["kv_cache_budget_bytes"] = stats.kv_cache_budget_bytes;
+    model_stats["num_kv_cache_stalls"] = stats.num_kv_cache_stalls;
+    for (size_t i = 0; i < oas::kNumRequestPriorities; ++i) {
+      auto& class_stats = stats.priority_classes[i];
+      json& class_json = model_stats["priority_classes"][oas::RequestPriorityName(static_cast<oas::RequestPriority>(i))];
+      class_json["queue_depth"] = class_stats.queue_depth;
+      class_json["num_completed"] = class_stats.num_completed;
+      class_json["num_slo_met"] = class_stats.num_slo_met;
+      class_json["avg_ttft_ms"] = class_stats.avg_ttft_ms;
+      class_json["avg_latency_ms"] = class_stats.avg_latency_ms;
+    }
+    model_stats["tenants"] = json::object();
+    for (auto& [tenant_id, tenant_stats] : stats.tenants) {
+      json& tenant_json = model_stats["tenants"][tenant_id];
+      tenant_json["weight"] = tenant_stats.weight;
+      tenant_json["queue_depth"] = tenant_stats.queue_depth;
+      tenant_json["active"] = tenant_stats.active;
+      tenant_json["num_admitted"] = tenant_stats.num_admitted;
+      tenant_json["num_completed"] = tenant_stats.num_completed;
+      tenant_json["num_generated_tokens"] = tenant_stats.num_generated_tokens;
+    }
+  }
+  for (auto& [model_id, stats] : model_mgr.GetTokenizationCacheStats()) {
+    json& cache_json = ret["stats"][model_id]["tokenization_cache"];
+    cache_json["num_segments"] = stats.num_segments;
+    cache_json["num_bytes"] = stats.num_bytes;
+    cache_json["num_hits"] = stats.num_hits;
+    cache_json["num_misses"] = stats.num_misses;
+    cache_json["num_hit_chars"] = stats.num_hit_chars;
+    cache_json["num_evicted"] = stats.num_evicted;
+    cache_json["num_boundary_checks"] = stats.num_boundary_checks;
+    cache_json["num_verified"] = stats.num_verified;
+    cache_json["num_mismatches"] = stats.num_mismatches;
+    cache_json["splicing_enabled"] = stats.splicing_enabled;
+  }
+  for (auto& [model_id, stats] : model_mgr.GetTokenizerStreamPoolStats()) {
+    json& streams_json = ret["stats"][model_id]["tokenizer_streams"];
+    streams_json["capacity"] = stats.capacity;
+    streams_json["num_idle"] = stats.num_idle;
+    streams_json["num_acquired"] = stats.num_acquired;
+    streams_json["num_misses"] = stats.num_misses;
+  }
+  for (auto& [model_id, stats] : model_mgr.GetModelMemoryStats()) {
+    json& memory_json = ret["stats"][model_id]["memory"];
+    memory_json["memory_mb"] = stats.memory_bytes >> 20;
+    memory_json["pinned"] = stats.pinned;
+    memory_json["eviction_priority"] = stats.eviction_priority;
+    memory_json["idle_ttl_secs"] = stats.idle_ttl_secs;
+    memory_json["idle_secs"] = stats.idle_secs;
+  }
+  for (auto& [model_id, stats] : model_mgr.GetRequestCoalescerStats()) {
+    json& coalescing_json = ret["stats"][model_id]["coalescing"];
+    coalescing_json["num_in_flight"] = stats.num_in_flight;
+    coalescing_json["num_subscribers"] = stats.num_subscribers;
+    coalescing_json["num_coalesced"] = stats.num_coalesced;
+  }
+  for (auto& [model_id, stats] : model_mgr.GetResponseCacheStats()) {
+    json& cache_json = ret["stats"][model_id]["response_cache"];
+    cache_json["num_entries"] = stats.num_entries;
+    cache_json["num_bytes"] = stats.num_bytes;
+    cache_json["num_hits"] = stats.num_hits;
+    cache_json["num_misses"] = stats.num_misses;
+    cache_json["hit_rate"] = stats.num_hits + stats.num_misses ? static_cast<double>(stats.num_hits) / (stats.num_hits + stats.num_misses) : 0;
+    cache_json["num_inserts"] = stats.num_inserts;
+    cache_json["num_evicted"] = stats.num_evicted;
+  }
   res.status = 200;
   res.set_content(ret.dump(), "application/json");
 }
@@ -244,7 +842,18 @@ static void HandleListModels(oas::ModelManager& model_mgr, const httplib::Reques
 }
 
 static void HandleUnloadModel(oas::ModelManager& model_mgr, const httplib::Request& req, httplib::Response& res) {
-  res.set_content("Not implemented", "application/text");
+  res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
+  json req_data = json::parse(req.body);
+  const std::string model_id = req_data["model"].get<std::string>();
+  spdlog::debug("Unloading model [{}]", model_id);
+  auto st = model_mgr.UnloadModel(model_id);
+  if (st == oas::Status::kModelNotLoaded) {
+    res.status = 400;
+    res.set_content("Model is not loaded", "application/text");
+    return;
+  }
+  res.status = 200;
+  res.set_content("Unloaded model; its memory is freed once its requests in flight are done", "application/text");
 }
 
 static void HandlePullModel(oas::ModelManager& model_mgr, const ServerConfig& svr_config, const httplib::Request& req, httplib::Response& res) {
@@ -283,7 +892,15 @@ static void HandleLoadModel(oas::ModelManager& model_mgr, const httplib::Request
   json req_data = json::parse(req.body);
   const std::string model_id = req_data["model"].get<std::string>();
   spdlog::debug("Loading model [{}]", model_id);
-  auto st = model_mgr.LoadModel(model_id);
+  // the model loads in the background unless the request asks to wait for it
+  auto load = model_mgr.LoadModelAsync(model_id);
+  if (!oas::GetJsonValue<bool>(req_data, "wait", false) &&
+      load.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+    res.status = 202;
+    res.set_content("Loading model; see /v1/load/status", "application/text");
+    return;
+  }
+  auto st = load.get();
   switch (st) {
     case oas::Status::kFail: {
       res.status = 500;
@@ -300,6 +917,11 @@ static void HandleLoadModel(oas::ModelManager& model_mgr, const httplib::Request
       res.set_content("Model was not pulled before", "application/text");
       break;
     }
+    case oas::Status::kMemoryBudgetExceeded: {
+      res.status = 503;
+      res.set_content("Not enough memory to load the model; the models loaded are busy or pinned", "application/text");
+      break;
+    }
     case oas::Status::kOk: {
       res.status = 200;
       res.set_content("Loaded model successfully", "application/text");
@@ -308,6 +930,17 @@ static void HandleLoadModel(oas::ModelManager& model_mgr, const httplib::Request
   }
 }
 
+static void HandleModelLoadStatus(oas::ModelManager& model_mgr, const httplib::Request& req, httplib::Response& res) {
+  json ret = json::object();
+  for (auto& [model_id, status] : model_mgr.GetModelLoadStatus()) {
+    json& load_json = ret["loads"][model_id];
+    load_json["phase"] = oas::ModelLoadPhaseName(status.phase);
+    load_json["elapsed_ms"] = status.elapsed_ms;
+  }
+  res.status = 200;
+  res.set_content(ret.dump(), "application/json");
+}
+
 static void SetupEndpoints(httplib::Server& svr, oas::ModelManager& model_mgr, const ServerConfig& svr_config) {
   svr.Get("/v1/health", [&](const httplib::Request& req, httplib::Response& res) {
     res.status = 200;
@@ -331,12 +964,16 @@ static void SetupEndpoints(httplib::Server& svr, oas::ModelManager& model_mgr, c
     HandleLoadModel(model_mgr, req, res);
   });
 
+  svr.Get("/v1/load/status", [&model_mgr](const httplib::Request& req, httplib::Response& res) {
+    HandleModelLoadStatus(model_mgr, req, res);
+  });
+
   svr.Post("/v1/unload", [&model_mgr](const httplib::Request& req, httplib::Response& res) {
     HandleUnloadModel(model_mgr, req, res);
   });
 
-  svr.Post("/v1/chat/completions", [&model_mgr](const httplib::Request& req, httplib::Response& res) {
-    HandleChatCompletions(model_mgr, req, res);
+  svr.Post("/v1/chat/completions", [&model_mgr, &svr_config](const httplib::Request& req, httplib::Response& res) {
+    HandleChatCompletions(model_mgr, svr_config, req, res);
   });
 }
 
@@ -356,9 +993,12 @@ static void ServerLogger(const httplib::Request& req, const httplib::Response& r
 
 static void SetupServer(const ServerConfig& svr_config, httplib::Server& svr) {
   svr.set_logger(ServerLogger);
-  if (svr_config.nthreads != 0) {
-    spdlog::debug("Using threadcount of [{}]", svr_config.nthreads);
-    svr.new_task_queue = [&svr_config] { return new httplib::ThreadPool(svr_config.nthreads); };
+  if (svr_config.nthreads != 0 || svr_config.max_queued_connections != 0) {
+    size_t nthreads = svr_config.nthreads != 0 ? svr_config.nthreads : CPPHTTPLIB_THREAD_POOL_COUNT;
+    spdlog::debug("Using threadcount of [{}], max queued connections [{}]", nthreads, svr_config.max_queued_connections);
+    svr.new_task_queue = [nthreads, &svr_config] {
+      return new httplib::ThreadPool(nthreads, svr_config.max_queued_connections);
+    };
   }
   svr.set_error_handler([](const httplib::Request&, httplib::Response& res) {
     if (res.status == 401) {
@@ -383,6 +1023,10 @@ static void SetupServer(const ServerConfig& svr_config, httplib::Server& svr) {
     res.status = 500;
   });
 
+  svr.set_post_routing_handler([&svr_config](const httplib::Request& req, httplib::Response& res) {
+    CompressResponse(svr_config.compression, req, res);
+  });
+
   // TODO: setup read/write timeouts
 }
 
@@ -403,6 +1047,83 @@ static void ReadCmdLineParams(int argc, char** argv, ServerConfig& svr_config) {
   app.add_option("-n,--hostname", svr_config.host, "Hostname to listen on (default: localhost)");
   app.add_option("-p,--port", svr_config.port, "Port number to listen on (default: 8080)");
   app.add_option("-t,--nthreads", svr_config.nthreads, "Numbter of threads to use");
+  app.add_option("-b,--max_batch_size", svr_config.engine_config.max_batch_size,
+                 "Max number of requests a model decodes together; upper bound of the adaptive limit (default: 8)")
+      ->check(CLI::PositiveNumber);
+  app.add_option("-w,--inference_threads", svr_config.engine_config.num_inference_threads,
+                 "Number of threads running model inference, independent of --nthreads (default: number of cores)")
+      ->check(CLI::PositiveNumber);
+  app.add_option("--max_queued_connections", svr_config.max_queued_connections,
+                 "Max connections waiting for an http thread; excess connections are closed (default: unbounded)");
+  app.add_option("--max_queue_depth", svr_config.engine_config.max_queue_depth,
+                 "Max requests queued per model before shedding with 429; 0 means unbounded (default: 64)");
+  app.add_option("--max_queue_wait_ms", svr_config.engine_config.max_queue_wait_ms,
+                 "Max time a request waits in a model's queue before shedding with 429; 0 means no limit (default: 30000)");
+  app.add_option("--interactive_reserved_slots", svr_config.engine_config.interactive_reserved_slots,
+                 "Batch slots per model that only interactive priority requests can use (default: 2)");
+  app.add_option("--interactive_ttft_slo_ms", svr_config.engine_config.interactive_ttft_slo_ms,
+                 "Target time to first token for interactive priority requests (default: 1000)");
+  app.add_option("--batch_latency_slo_ms", svr_config.engine_config.batch_latency_slo_ms,
+                 "Target end-to-end latency for batch priority requests (default: 60000)");
+  app.add_option("--tenant_weight", svr_config.tenant_weights,
+                 "Fair share weight of a tenant as <tenant>=<weight>; can be repeated (default weight: 1)");
+  app.add_option("--max_tenant_batch_share", svr_config.engine_config.max_tenant_batch_share,
+                 "Share of a model's batch one tenant can hold while other tenants are waiting (default: 0.5)")
+      ->check(CLI::Range(0.0, 1.0));
+  app.add_option("--trust_tenant_header", svr_config.trust_tenant_header,
+                 "Take the tenant of requests from the X-Tenant-Id header rather than the API key; only for servers "
+                 "behind a gateway that sets it (default: false)");
+  app.add_option("--default_request_timeout_ms", svr_config.engine_config.default_request_timeout_ms,
+                 "Deadline for chat requests that don't set 'timeout'; 0 means none (default: 0)");
+  app.add_option("--queue_policy", svr_config.engine_config.queue_policy,
+                 "Order of queued requests: fcfs or sjf (shortest estimated job first) (default: fcfs)")
+      ->check(CLI::IsMember({"fcfs", "sjf"}));
+  app.add_option("--sjf_aging_tokens_per_sec", svr_config.engine_config.sjf_aging_tokens_per_sec,
+                 "How fast a waiting request's estimated cost decays with sjf so large requests aren't starved (default: 100)");
+  app.add_option("--adaptive_concurrency", svr_config.engine_config.adaptive_concurrency,
+                 "Adjust each model's batch limit from its observed step latency (default: true)");
+  app.add_option("--min_concurrency", svr_config.engine_config.min_concurrency,
+                 "Lower bound of the adaptive batch limit (default: 1)")
+      ->check(CLI::PositiveNumber);
+  app.add_option("--concurrency_latency_tolerance", svr_config.engine_config.concurrency_latency_tolerance,
+                 "Ratio of step latency to its baseline tolerated before the batch limit shrinks (default: 1.5)")
+      ->check(CLI::Range(1.0, 100.0));
+  app.add_option("--max_prefill_tokens_in_flight", svr_config.engine_config.max_prefill_tokens_in_flight,
+                 "Max prompt tokens per model being prefilled at once alongside its decode batch; a longer prompt is "
+                 "still prefilled in one go (default: 512)")
+      ->check(CLI::PositiveNumber);
+  app.add_option("--kv_cache_budget_mb", svr_config.engine_config.kv_cache_budget_mb,
+                 "KV cache memory the admitted requests of a model may hold; 0 means no limit (default: 0)");
+  app.add_option("--kv_cache_bytes_per_element", svr_config.engine_config.kv_cache_bytes_per_element,
+                 "Size of a KV cache element used to estimate its memory: 2 for fp16, 4 for fp32 (default: 2)")
+      ->check(CLI::PositiveNumber);
+  app.add_option("--response_cache_mb", svr_config.engine_config.response_cache_mb,
+                 "Memory for responses of deterministic (do_sample=false) requests kept per model; 0 disables it (default: 64)");
+  app.add_option("--tokenization_cache_mb", svr_config.engine_config.tokenization_cache_mb,
+                 "Memory for token ids of prompt segments kept per model to skip re-encoding templates; spliced prompts can "
+                 "tokenize differently from whole ones with tokenizers that merge across newlines. 0 disables it (default: 0)");
+  app.add_option("--token_text_table", svr_config.engine_config.token_text_table,
+                 "Decode streamed tokens with a table built from the model's tokenizer.json instead of the GenAI API (default: false)");
+  app.add_option("--coalesce_requests", svr_config.engine_config.coalesce_requests,
+                 "Identical deterministic requests in flight together share one generation (default: true)");
+  app.add_option("--model_memory_budget_mb", svr_config.engine_config.model_memory_budget_mb,
+                 "Memory all loaded models may take up (their files plus --kv_cache_budget_mb each); least recently "
+                 "used idle models are evicted to make room for new ones. 0 means no limit (default: 0)");
+  app.add_option("--model_idle_ttl_secs", svr_config.engine_config.model_idle_ttl_secs,
+                 "Models that get no requests for this long are unloaded; 'idle_ttl_secs' in the manifest overrides it "
+                 "per model. 0 means never (default: 0)");
+  app.add_option("--stream_flush_tokens", svr_config.stream_flush_policy.max_tokens,
+                 "Streams write their tokens once this many are buffered; 0 means no limit. Without any "
+                 "--stream_flush_* limit every token is written at once, and so is the first token always (default: 0)");
+  app.add_option("--stream_flush_interval_ms", svr_config.stream_flush_policy.max_delay_ms,
+                 "Streams write tokens that have been buffered for this long; 0 means no limit (default: 0)");
+  app.add_option("--stream_adaptive_flush", svr_config.stream_flush_policy.adaptive,
+                 "Streams batch tokens only while writing lags behind generation (default: false)");
+  app.add_option("--compression_level", svr_config.compression.level,
+                 "zlib level (1-9) of gzip/deflate compressed responses; 0 turns compression off (default: 0)")
+      ->check(CLI::Range(0, 9));
+  app.add_option("--compression_min_bytes", svr_config.compression.min_bytes,
+                 "Response bodies smaller than this aren't compressed (default: 1024)");
   app.add_option("-i,--model_id", svr_config.cmd_line_model_id,
                  "Model id (required if --model is used. "
                  "Model id is used to identify the model in the server.)");
@@ -415,6 +1136,19 @@ static void ReadCmdLineParams(int argc, char** argv, ServerConfig& svr_config) {
   } catch (CLI::Error& e) {
     exit(app.exit(e));
   }
+  for (auto& tenant_weight : svr_config.tenant_weights) {
+    auto pos = tenant_weight.rfind('=');
+    double weight = 0;
+    try {
+      weight = pos == std::string::npos ? 0 : std::stod(tenant_weight.substr(pos + 1));
+    } catch (const std::exception&) {
+    }
+    if (weight <= 0) {
+      std::cerr << "Invalid --tenant_weight [" << tenant_weight << "]; expected <tenant>=<positive weight>\n";
+      exit(1);
+    }
+    svr_config.engine_config.tenant_weights[tenant_weight.substr(0, pos)] = weight;
+  }
 }
 
 int main(int argc, char** argv) {
@@ -424,7 +1158,7 @@ int main(int argc, char** argv) {
   if (svr_config.verbose_mode)
     spdlog::set_level(spdlog::level::level_enum::debug);
 
-  oas::ModelManager model_mgr(svr_config.downloaded_models_path);
+  oas::ModelManager model_mgr(svr_config.downloaded_models_path, svr_config.engine_config);
 
   // Read manifest file if supplied
   if (!svr_config.model_manifest_file.empty()) {
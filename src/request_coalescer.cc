@@ -0,0 +1,50 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "request_coalescer.h"
+
+namespace oas {
+std::shared_ptr<GenerationRequest> RequestCoalescer::Subscribe(const std::shared_ptr<GenerationRequest>& request) {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto& entry = in_flight[request->deterministic_key];
+  if (entry.generation && !entry.generation->IsCancelled()) {
+    ++entry.num_subscribers;
+    ++stats.num_coalesced;
+    return entry.generation;
+  }
+  entry.generation = request;
+  entry.num_subscribers = 1;
+  return request;
+}
+
+bool RequestCoalescer::Unsubscribe(const GenerationRequest& generation) {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto it = in_flight.find(generation.deterministic_key);
+  if (it == in_flight.end() || it->second.generation.get() != &generation) {
+    return false;
+  }
+  if (--it->second.num_subscribers) {
+    return false;
+  }
+  in_flight.erase(it);
+  return true;
+}
+
+void RequestCoalescer::Remove(const GenerationRequest& generation) {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto it = in_flight.find(generation.deterministic_key);
+  if (it != in_flight.end() && it->second.generation.get() == &generation) {
+    in_flight.erase(it);
+  }
+}
+
+RequestCoalescerStats RequestCoalescer::GetStats() {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto ret = stats;
+  ret.num_in_flight = in_flight.size();
+  for (auto& [_, entry] : in_flight) {
+    ret.num_subscribers += entry.num_subscribers;
+  }
+  return ret;
+}
+}  // namespace oas
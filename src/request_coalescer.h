@@ -0,0 +1,46 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "generation_engine.h"
+
+namespace oas {
+struct RequestCoalescerStats {
+  size_t num_in_flight = 0;  // generations identical requests can subscribe to
+  size_t num_subscribers = 0;  // clients reading those generations
+  size_t num_coalesced = 0;  // requests served by another request's generation
+};
+
+// Lets identical deterministic requests of a model that are in flight together share a single generation.
+// The first request of a key runs; later ones subscribe to it and read its tokens from the start, so
+// clients that join late catch up. The generation is cancelled only when its last subscriber is gone.
+class RequestCoalescer {
+ public:
+  // Returns the generation in flight with the key of request, or registers request as the generation
+  // for its key and returns it. Either way the caller becomes a subscriber of the returned generation.
+  std::shared_ptr<GenerationRequest> Subscribe(const std::shared_ptr<GenerationRequest>& request);
+  // Drops a subscriber of generation. Returns true if nobody else reads it so it can be cancelled, and false
+  // if others still do or the generation isn't tracked anymore (it's over; see Remove()).
+  bool Unsubscribe(const GenerationRequest& generation);
+  // Stops new requests from subscribing to generation once it has finished or was shed; its remaining
+  // subscribers just read it to the end.
+  void Remove(const GenerationRequest& generation);
+  RequestCoalescerStats GetStats();
+
+ private:
+  struct InFlight {
+    std::shared_ptr<GenerationRequest> generation;
+    size_t num_subscribers = 0;
+  };
+
+  std::unordered_map<std::string, InFlight> in_flight;  // keyed by GenerationRequest::deterministic_key
+  RequestCoalescerStats stats;
+  std::mutex mtx;
+};
+}  // namespace oas
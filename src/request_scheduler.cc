@@ -0,0 +1,258 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <algorithm>
+#include <cmath>
+
+#include "request_scheduler.h"
+#include "generation_engine.h"
+
+namespace oas {
+namespace {
+// Tokens a tenant of weight 1 may be charged per round of deficit round robin.
+constexpr double kDrrQuantumTokens = 256;
+}  // namespace
+
+const char* RequestPriorityName(RequestPriority priority) {
+  switch (priority) {
+    case RequestPriority::kInteractive:
+      return "interactive";
+    case RequestPriority::kBatch:
+      return "batch";
+  }
+  return "unknown";
+}
+
+bool ParseRequestPriority(const std::string& str, RequestPriority& priority) {
+  for (size_t i = 0; i < kNumRequestPriorities; ++i) {
+    if (str == RequestPriorityName(static_cast<RequestPriority>(i))) {
+      priority = static_cast<RequestPriority>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+double FcfsQueuePolicy::Rank(const GenerationRequest& request, std::chrono::steady_clock::time_point) const {
+  return std::chrono::duration<double>(request.GetEnqueueTime().time_since_epoch()).count();
+}
+
+double ShortestJobFirstQueuePolicy::Rank(const GenerationRequest& request,
+                                         std::chrono::steady_clock::time_point now) const {
+  auto waited_secs = std::chrono::duration<double>(now - request.GetEnqueueTime()).count();
+  return request.EstimateCost() - aging_tokens_per_sec * waited_secs;
+}
+
+std::unique_ptr<QueuePolicy> CreateQueuePolicy(const std::string& name, double sjf_aging_tokens_per_sec) {
+  if (name == "fcfs") {
+    return std::make_unique<FcfsQueuePolicy>();
+  }
+  if (name == "sjf") {
+    return std::make_unique<ShortestJobFirstQueuePolicy>(sjf_aging_tokens_per_sec);
+  }
+  return nullptr;
+}
+
+RequestScheduler::RequestScheduler(const std::unordered_map<std::string, double>& tenant_weights0,
+                                   std::unique_ptr<QueuePolicy> queue_policy0)
+    : tenant_weights(tenant_weights0), queue_policy(std::move(queue_policy0)) {
+}
+
+RequestScheduler::Tenant& RequestScheduler::GetTenant(const std::string& tenant_id) {
+  auto it = tenants.find(tenant_id);
+  if (it != tenants.end()) {
+    return it->second;
+  }
+  auto& tenant = tenants[tenant_id];
+  auto wit = tenant_weights.find(tenant_id);
+  tenant.stats.weight = wit != tenant_weights.end() ? wit->second : 1;
+  return tenant;
+}
+
+void RequestScheduler::EraseIfIdle(const std::string& tenant_id) {
+  auto it = tenants.find(tenant_id);
+  if (it != tenants.end() && !it->second.num_pending && !it->second.num_running && !tenant_weights.count(tenant_id)) {
+    tenants.erase(it);
+  }
+}
+
+void RequestScheduler::Push(std::shared_ptr<GenerationRequest> request) {
+  auto& tenant = GetTenant(request->tenant);
+  if (tenant.num_pending++ == 0) {
+    ++num_backlogged_tenants;
+  }
+  auto& queue = queues[static_cast<size_t>(request->priority)];
+  auto& tenant_queue = queue.tenant_queues[request->tenant];
+  if (tenant_queue.empty()) {
+    queue.round_robin.push_back(request->tenant);
+  }
+  tenant_queue.push_back(std::move(request));
+  ++queue.size;
+  ++size;
+}
+
+std::shared_ptr<GenerationRequest> RequestScheduler::Pop(const AdmitPredicate& can_admit) {
+  // queues are ordered from the highest to the lowest priority
+  for (auto& queue : queues) {
+    if (auto request = PopFromQueue(queue, can_admit)) {
+      return request;
+    }
+  }
+  return nullptr;
+}
+
+std::shared_ptr<GenerationRequest> RequestScheduler::PopFromQueue(PriorityQueue& queue, const AdmitPredicate& can_admit) {
+  auto& round_robin = queue.round_robin;
+  while (!round_robin.empty()) {
+    // Serve the first tenant in round robin order that has credit left and an admissible request.
+    double rounds_needed = 0;
+    for (size_t n = round_robin.size(); n > 0; --n) {
+      const auto tenant_id = round_robin.front();
+      auto& tenant = tenants.at(tenant_id);
+      auto it = SelectNext(queue.tenant_queues.at(tenant_id));
+      if (can_admit(**it)) {
+        if (tenant.deficit > 0) {
+          return PopFromTenant(queue, tenant_id, it);
+        }
+        auto quantum = kDrrQuantumTokens * tenant.stats.weight;
+        auto rounds = std::floor(-tenant.deficit / quantum) + 1;
+        rounds_needed = rounds_needed ? std::min(rounds_needed, rounds) : rounds;
+      }
+      round_robin.pop_front();
+      round_robin.push_back(tenant_id);
+    }
+    if (!rounds_needed) {
+      return nullptr;  // nothing can be admitted right now
+    }
+    // Every admissible tenant is out of credit; skip ahead to the round in which the first one has credit again.
+    for (auto& tenant_id : round_robin) {
+      auto& tenant = tenants.at(tenant_id);
+      tenant.deficit += rounds_needed * kDrrQuantumTokens * tenant.stats.weight;
+    }
+  }
+  return nullptr;
+}
+
+RequestScheduler::TenantQueue::iterator RequestScheduler::SelectNext(TenantQueue& tenant_queue) const {
+  auto now = std::chrono::steady_clock::now();
+  auto best = tenant_queue.begin();
+  auto best_rank = queue_policy->Rank(**best, now);
+  for (auto it = std::next(best); it != tenant_queue.end(); ++it) {
+    auto rank = queue_policy->Rank(**it, now);
+    if (rank < best_rank) {
+      best = it;
+      best_rank = rank;
+    }
+  }
+  return best;
+}
+
+std::shared_ptr<GenerationRequest> RequestScheduler::PopFromTenant(PriorityQueue& queue, const std::string& tenant_id,
+                                                                   TenantQueue::iterator it) {
+  auto& tenant = tenants.at(tenant_id);
+  auto& tenant_queue = queue.tenant_queues.at(tenant_id);
+  auto request = std::move(*it);
+  tenant_queue.erase(it);
+  --queue.size;
+  --size;
+  if (--tenant.num_pending == 0) {
+    --num_backlogged_tenants;
+  }
+  ++tenant.stats.num_admitted;
+  ++tenant.num_running;
+  tenant.deficit -= request->EstimateNewTokens();
+  if (tenant_queue.empty()) {
+    queue.tenant_queues.erase(tenant_id);
+    queue.round_robin.pop_front();
+    if (!tenant.num_pending) {
+      tenant.deficit = 0;  // idle tenants don't bank credit
+    }
+  } else if (tenant.deficit <= 0) {
+    queue.round_robin.pop_front();
+    queue.round_robin.push_back(tenant_id);
+  }
+  return request;
+}
+
+void RequestScheduler::OnCompleted(const GenerationRequest& request) {
+  auto it = tenants.find(request.tenant);
+  if (it == tenants.end()) {
+    return;
+  }
+  auto& tenant = it->second;
+  if (tenant.num_running) {
+    --tenant.num_running;
+  }
+  ++tenant.stats.num_completed;
+  tenant.stats.num_generated_tokens += request.GetNumGeneratedTokens();
+  // correct the estimate charged at admission with the number of tokens actually generated
+  if (tenant.num_pending) {
+    tenant.deficit += static_cast<double>(request.EstimateNewTokens()) - request.GetNumGeneratedTokens();
+  }
+  EraseIfIdle(request.tenant);
+}
+
+std::vector<std::shared_ptr<GenerationRequest>> RequestScheduler::RemoveCancelled() {
+  std::vector<std::shared_ptr<GenerationRequest>> ret;
+  for (auto& queue : queues) {
+    for (auto& [tenant_id, tenant_queue] : queue.tenant_queues) {
+      auto it = std::stable_partition(tenant_queue.begin(), tenant_queue.end(),
+                                      [](const auto& request) { return !request->IsCancelled(); });
+      auto num_removed = static_cast<size_t>(std::distance(it, tenant_queue.end()));
+      if (!num_removed) {
+        continue;
+      }
+      std::move(it, tenant_queue.end(), std::back_inserter(ret));
+      tenant_queue.erase(it, tenant_queue.end());
+      queue.size -= num_removed;
+      size -= num_removed;
+      auto& tenant = tenants.at(tenant_id);
+      tenant.num_pending -= num_removed;
+      if (!tenant.num_pending) {
+        --num_backlogged_tenants;
+        tenant.deficit = 0;
+        EraseIfIdle(tenant_id);
+      }
+    }
+    // drop the tenants that have nothing queued anymore
+    auto& round_robin = queue.round_robin;
+    round_robin.erase(std::remove_if(round_robin.begin(), round_robin.end(),
+                                     [&queue](const auto& tenant_id) { return queue.tenant_queues.at(tenant_id).empty(); }),
+                      round_robin.end());
+    for (auto it = queue.tenant_queues.begin(); it != queue.tenant_queues.end();) {
+      it = it->second.empty() ? queue.tenant_queues.erase(it) : std::next(it);
+    }
+  }
+  return ret;
+}
+
+std::vector<std::shared_ptr<GenerationRequest>> RequestScheduler::RemoveAll() {
+  std::vector<std::shared_ptr<GenerationRequest>> ret;
+  for (auto& queue : queues) {
+    for (auto& [_, tenant_queue] : queue.tenant_queues) {
+      std::move(tenant_queue.begin(), tenant_queue.end(), std::back_inserter(ret));
+    }
+    queue = PriorityQueue{};
+  }
+  for (auto& [_, tenant] : tenants) {
+    tenant.num_pending = 0;
+  }
+  size = 0;
+  num_backlogged_tenants = 0;
+  return ret;
+}
+
+size_t RequestScheduler::Size(RequestPriority priority) const {
+  return queues[static_cast<size_t>(priority)].size;
+}
+
+std::unordered_map<std::string, TenantStats> RequestScheduler::GetTenantStats() const {
+  std::unordered_map<std::string, TenantStats> ret;
+  for (auto& [tenant_id, tenant] : tenants) {
+    auto& stats = ret[tenant_id];
+    stats = tenant.stats;
+    stats.queue_depth = tenant.num_pending;
+  }
+  return ret;
+}
+}  // namespace oas
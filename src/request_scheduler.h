@@ -0,0 +1,122 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace oas {
+struct GenerationRequest;
+
+enum class RequestPriority {
+  kInteractive,  // time-to-first-token sensitive traffic like streaming chats; always served first
+  kBatch         // throughput oriented traffic; soaks up the capacity interactive traffic leaves
+};
+constexpr size_t kNumRequestPriorities = 2;
+
+const char* RequestPriorityName(RequestPriority priority);
+bool ParseRequestPriority(const std::string& str, RequestPriority& priority);
+
+constexpr const char* kDefaultTenant = "default";
+
+struct TenantStats {
+  double weight = 1;
+  size_t queue_depth = 0;
+  size_t active = 0;  // filled in by the engine
+  size_t num_admitted = 0;
+  size_t num_completed = 0;
+  size_t num_generated_tokens = 0;
+};
+
+// Decides the order in which a tenant's queued requests are admitted.
+class QueuePolicy {
+ public:
+  virtual ~QueuePolicy() = default;
+  // Requests with a lower rank are admitted first.
+  virtual double Rank(const GenerationRequest& request, std::chrono::steady_clock::time_point now) const = 0;
+};
+
+// First come first served.
+class FcfsQueuePolicy : public QueuePolicy {
+ public:
+  double Rank(const GenerationRequest& request, std::chrono::steady_clock::time_point now) const override;
+};
+
+// Shortest estimated job first. A request's rank is its estimated cost in tokens minus
+// aging_tokens_per_sec for every second it has waited, so that large requests aren't starved.
+class ShortestJobFirstQueuePolicy : public QueuePolicy {
+ public:
+  ShortestJobFirstQueuePolicy(double aging_tokens_per_sec0) : aging_tokens_per_sec(aging_tokens_per_sec0) {}
+  double Rank(const GenerationRequest& request, std::chrono::steady_clock::time_point now) const override;
+
+ private:
+  double aging_tokens_per_sec;
+};
+
+// Returns nullptr if the policy name isn't recognized.
+std::unique_ptr<QueuePolicy> CreateQueuePolicy(const std::string& name, double sjf_aging_tokens_per_sec);
+
+// Orders the requests waiting for a slot in a model's batch.
+// Priority classes are served strictly in order. Within a class, tenants share the model through
+// deficit round robin weighted by generated tokens: a tenant is charged the estimated number of
+// new tokens when its request is admitted and the estimate is corrected once the request completes.
+// The order of each tenant's own requests is left to the QueuePolicy.
+// Tenants without a configured weight are only tracked while they have requests queued or running, so
+// tenant ids that come and go don't pile up.
+// Not thread safe; the owning engine serializes access.
+class RequestScheduler {
+ public:
+  using AdmitPredicate = std::function<bool(const GenerationRequest&)>;
+
+  RequestScheduler(const std::unordered_map<std::string, double>& tenant_weights0,
+                   std::unique_ptr<QueuePolicy> queue_policy0);
+
+  void Push(std::shared_ptr<GenerationRequest> request);
+  // Returns the next request to admit or nullptr if there's none.
+  // Requests for which can_admit returns false are skipped over.
+  std::shared_ptr<GenerationRequest> Pop(const AdmitPredicate& can_admit);
+  void OnCompleted(const GenerationRequest& request);
+  std::vector<std::shared_ptr<GenerationRequest>> RemoveCancelled();
+  std::vector<std::shared_ptr<GenerationRequest>> RemoveAll();
+  size_t Size() const { return size; }
+  size_t Size(RequestPriority priority) const;
+  size_t NumBackloggedTenants() const { return num_backlogged_tenants; }
+  std::unordered_map<std::string, TenantStats> GetTenantStats() const;
+
+ private:
+  struct Tenant {
+    double deficit = 0;  // in tokens
+    size_t num_pending = 0;
+    size_t num_running = 0;  // admitted and not completed yet
+    TenantStats stats;
+  };
+  using TenantQueue = std::deque<std::shared_ptr<GenerationRequest>>;
+  struct PriorityQueue {
+    std::unordered_map<std::string, TenantQueue> tenant_queues;
+    std::deque<std::string> round_robin;  // tenants with requests in tenant_queues
+    size_t size = 0;
+  };
+
+  Tenant& GetTenant(const std::string& tenant_id);
+  // Drops the tenant once it has nothing queued or running, unless it has a configured weight.
+  void EraseIfIdle(const std::string& tenant_id);
+  std::shared_ptr<GenerationRequest> PopFromQueue(PriorityQueue& queue, const AdmitPredicate& can_admit);
+  std::shared_ptr<GenerationRequest> PopFromTenant(PriorityQueue& queue, const std::string& tenant_id,
+                                                   TenantQueue::iterator it);
+  TenantQueue::iterator SelectNext(TenantQueue& tenant_queue) const;
+
+  std::unordered_map<std::string, double> tenant_weights;
+  std::unique_ptr<QueuePolicy> queue_policy;
+  std::unordered_map<std::string, Tenant> tenants;
+  std::array<PriorityQueue, kNumRequestPriorities> queues;
+  size_t size = 0;
+  size_t num_backlogged_tenants = 0;
+};
+}  // namespace oas
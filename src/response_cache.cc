@@ -0,0 +1,63 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "response_cache.h"
+
+namespace oas {
+ResponseCache::ResponseCache(size_t capacity_bytes0)
+    : capacity_bytes(capacity_bytes0) {
+}
+
+bool ResponseCache::Get(const std::string& key, std::vector<int32_t>& output_tokens) {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto it = entries.find(key);
+  if (it == entries.end()) {
+    ++stats.num_misses;
+    return false;
+  }
+  ++stats.num_hits;
+  lru.splice(lru.begin(), lru, it->second.lru_it);
+  output_tokens = it->second.output_tokens;
+  return true;
+}
+
+void ResponseCache::Put(const std::string& key, std::vector<int32_t> output_tokens) {
+  auto entry_bytes = EntryBytes(key, output_tokens);
+  if (entry_bytes > capacity_bytes) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mtx);
+  auto it = entries.find(key);
+  if (it != entries.end()) {
+    // a concurrent identical request finished first
+    Erase(it);
+  }
+  auto& entry = entries[key];
+  stats.num_bytes += entry_bytes;
+  ++stats.num_inserts;
+  entry.output_tokens = std::move(output_tokens);
+  entry.lru_it = lru.insert(lru.begin(), key);
+  while (stats.num_bytes > capacity_bytes && !lru.empty()) {
+    Erase(entries.find(lru.back()));
+    ++stats.num_evicted;
+  }
+}
+
+ResponseCacheStats ResponseCache::GetStats() {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto ret = stats;
+  ret.num_entries = entries.size();
+  return ret;
+}
+
+size_t ResponseCache::EntryBytes(const std::string& key, const std::vector<int32_t>& output_tokens) {
+  // the key is stored twice: in the map and in the lru list
+  return 2 * key.size() + output_tokens.size() * sizeof(int32_t);
+}
+
+void ResponseCache::Erase(std::unordered_map<std::string, Entry>::iterator it) {
+  stats.num_bytes -= EntryBytes(it->first, it->second.output_tokens);
+  lru.erase(it->second.lru_it);
+  entries.erase(it);
+}
+}  // namespace oas
@@ -0,0 +1,51 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace oas {
+struct ResponseCacheStats {
+  size_t num_entries = 0;
+  size_t num_bytes = 0;
+  size_t num_hits = 0;
+  size_t num_misses = 0;
+  size_t num_inserts = 0;
+  size_t num_evicted = 0;
+};
+
+// Generated token ids of deterministic (non-sampling) requests of a model, keyed by their prompt token ids and
+// search options, so that repeating a request replays its response without running the model.
+// The least recently used responses are evicted once the cache holds more than capacity_bytes.
+// The cache belongs to a loaded model, so reloading the model starts with an empty one.
+class ResponseCache {
+ public:
+  explicit ResponseCache(size_t capacity_bytes0);
+
+  // Returns false if the key isn't cached.
+  bool Get(const std::string& key, std::vector<int32_t>& output_tokens);
+  void Put(const std::string& key, std::vector<int32_t> output_tokens);
+  ResponseCacheStats GetStats();
+
+ private:
+  struct Entry {
+    std::vector<int32_t> output_tokens;
+    std::list<std::string>::iterator lru_it;
+  };
+
+  static size_t EntryBytes(const std::string& key, const std::vector<int32_t>& output_tokens);
+  void Erase(std::unordered_map<std::string, Entry>::iterator it);
+
+  const size_t capacity_bytes;
+  std::unordered_map<std::string, Entry> entries;
+  std::list<std::string> lru;  // most recently used first
+  ResponseCacheStats stats;
+  std::mutex mtx;
+};
+}  // namespace oas
@@ -0,0 +1,284 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <fstream>
+#include <unordered_map>
+#include <experimental/filesystem>
+
+#include "spdlog/spdlog.h"
+#include "json.hpp"
+#include "utils.h"
+#include "token_text_table.h"
+
+using json = nlohmann::json;
+namespace fs = std::experimental::filesystem;
+
+namespace oas {
+// Tokens compared with the GenAI API when the table is built.
+constexpr size_t kNumVerifiedTokens = 1024;
+constexpr std::string_view kSentencePieceSpace = "\xE2\x96\x81";  // '▁'
+
+// Length of the UTF-8 sequence starting with lead; 0 if it can't start one.
+static size_t Utf8SequenceLength(unsigned char lead) {
+  if (lead < 0x80) return 1;
+  if ((lead & 0xE0) == 0xC0) return 2;
+  if ((lead & 0xF0) == 0xE0) return 3;
+  if ((lead & 0xF8) == 0xF0) return 4;
+  return 0;
+}
+
+// Returns the length of the prefix of bytes that doesn't end in the middle of a UTF-8 sequence.
+static size_t CompleteUtf8Prefix(std::string_view bytes) {
+  for (size_t k = 1; k <= std::min<size_t>(4, bytes.size()); ++k) {
+    auto c = static_cast<unsigned char>(bytes[bytes.size() - k]);
+    if ((c & 0xC0) != 0x80) {
+      return Utf8SequenceLength(c) > k ? bytes.size() - k : bytes.size();
+    }
+  }
+  return bytes.size();
+}
+
+static bool IsValidUtf8(std::string_view bytes) {
+  for (size_t i = 0; i < bytes.size();) {
+    auto len = Utf8SequenceLength(static_cast<unsigned char>(bytes[i]));
+    if (!len || i + len > bytes.size()) {
+      return false;
+    }
+    for (size_t k = 1; k < len; ++k) {
+      if ((static_cast<unsigned char>(bytes[i + k]) & 0xC0) != 0x80) {
+        return false;
+      }
+    }
+    i += len;
+  }
+  return true;
+}
+
+// Whether the GenAI API can decode bytes on their own: partial UTF-8 sequences don't decode alone and the API
+// returns C strings.
+static bool IsStandaloneText(std::string_view bytes) {
+  return IsValidUtf8(bytes) && bytes.find('\0') == std::string_view::npos;
+}
+
+// Decodes the code points of a UTF-8 string; returns false if it isn't valid.
+static bool DecodeUtf8(std::string_view bytes, std::vector<uint32_t>& code_points) {
+  if (!IsValidUtf8(bytes)) {
+    return false;
+  }
+  for (size_t i = 0; i < bytes.size();) {
+    auto c = static_cast<unsigned char>(bytes[i]);
+    auto len = Utf8SequenceLength(c);
+    uint32_t cp = len == 1 ? c : c & (0x7F >> len);
+    for (size_t k = 1; k < len; ++k) {
+      cp = (cp << 6) | (static_cast<unsigned char>(bytes[i + k]) & 0x3F);
+    }
+    code_points.push_back(cp);
+    i += len;
+  }
+  return true;
+}
+
+// Byte-level vocabularies spell every byte as a printable code point (GPT-2's bytes_to_unicode); this maps
+// those code points back to bytes.
+static const std::unordered_map<uint32_t, unsigned char>& GetByteLevelDecoder() {
+  static const auto decoder = [] {
+    std::unordered_map<uint32_t, unsigned char> ret;
+    uint32_t n = 0;
+    for (uint32_t b = 0; b < 256; ++b) {
+      bool printable = (b >= '!' && b <= '~') || (b >= 0xA1 && b <= 0xAC) || (b >= 0xAE && b <= 0xFF);
+      ret[printable ? b : 256 + n++] = static_cast<unsigned char>(b);
+    }
+    return ret;
+  }();
+  return decoder;
+}
+
+// Parses a SentencePiece byte fallback token such as <0x0A>.
+static bool ParseByteFallback(const std::string& piece, unsigned char& byte) {
+  if (piece.size() != 6 || piece.compare(0, 3, "<0x") != 0 || piece[5] != '>') {
+    return false;
+  }
+  try {
+    byte = static_cast<unsigned char>(std::stoi(piece.substr(3, 2), nullptr, 16));
+  } catch (const std::exception&) {
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<TokenTextTable> TokenTextTable::Create(const std::string& model_path, const OgaTokenizer& tokenizer) {
+  auto tokenizer_file = fs::path(model_path) / "tokenizer.json";
+  std::ifstream f(tokenizer_file);
+  if (!f.good()) {
+    spdlog::info("No [{}]; tokens will be decoded through the GenAI API", tokenizer_file.string());
+    return nullptr;
+  }
+  std::vector<std::pair<std::string, size_t>> pieces;
+  std::vector<size_t> added_tokens;
+  bool byte_level = false;
+  bool sentence_piece = false;
+  bool byte_fallback = false;
+  bool strips_leading_space = false;
+  try {
+    auto config = json::parse(f);
+    const auto& model = config.at("model");
+    auto model_type = GetJsonValue<std::string>(model, "type", "");
+    const auto& vocab = model.at("vocab");
+    if (vocab.is_object()) {
+      // BPE, WordLevel
+      for (auto& [piece, id] : vocab.items()) {
+        pieces.emplace_back(piece, id.get<size_t>());
+      }
+    } else if (model_type == "Unigram") {
+      for (size_t id = 0; id < vocab.size(); ++id) {
+        pieces.emplace_back(vocab[id].at(0).get<std::string>(), id);
+      }
+    }
+    if (ContainsJsonKey(config, "added_tokens")) {
+      for (auto& added_token : config["added_tokens"]) {
+        added_tokens.push_back(added_token.at("id").get<size_t>());
+      }
+    }
+    json decoders = json::array();
+    if (ContainsJsonKey(config, "decoder")) {
+      const auto& decoder = config["decoder"];
+      decoders = GetJsonValue<std::string>(decoder, "type", "") == "Sequence" ? decoder.at("decoders") : json::array({decoder});
+    }
+    for (auto& decoder : decoders) {
+      auto type = GetJsonValue<std::string>(decoder, "type", "");
+      if (type == "ByteLevel") {
+        byte_level = true;
+      } else if (type == "Metaspace") {
+        sentence_piece = true;
+        strips_leading_space = GetJsonValue<bool>(decoder, "add_prefix_space", true) &&
+                               GetJsonValue<std::string>(decoder, "prepend_scheme", "always") != "never";
+      } else if (type == "Replace") {
+        auto pattern = ContainsJsonKey(decoder, "pattern") ? GetJsonValue<std::string>(decoder["pattern"], "String", "") : "";
+        sentence_piece |= pattern == kSentencePieceSpace && GetJsonValue<std::string>(decoder, "content", "") == " ";
+      } else if (type == "ByteFallback") {
+        byte_fallback = true;
+      } else if (type == "Strip") {
+        strips_leading_space |= GetJsonValue<std::string>(decoder, "content", "") == " " &&
+                                GetJsonValue<size_t>(decoder, "start", 0) > 0;
+      }
+    }
+  } catch (const std::exception& e) {
+    spdlog::warn("Could not parse [{}]: {}; tokens will be decoded through the GenAI API", tokenizer_file.string(), e.what());
+    return nullptr;
+  }
+  if (pieces.empty() || byte_level == sentence_piece) {
+    spdlog::info("Tokenizer of [{}] isn't supported by the token text table; tokens will be decoded through the GenAI API", model_path);
+    return nullptr;
+  }
+
+  std::unique_ptr<TokenTextTable> table(new TokenTextTable);
+  table->strips_leading_space = sentence_piece && strips_leading_space;
+  size_t size = 0;
+  for (auto& [_, id] : pieces) {
+    size = std::max(size, id + 1);
+  }
+  for (auto id : added_tokens) {
+    size = std::max(size, id + 1);
+  }
+  table->texts.resize(size);
+  table->has_text.resize(size);
+  const auto& byte_level_decoder = GetByteLevelDecoder();
+  std::vector<uint32_t> code_points;
+  for (auto& [piece, id] : pieces) {
+    auto& text = table->texts[id];
+    unsigned char byte;
+    if (byte_level) {
+      code_points.clear();
+      if (!DecodeUtf8(piece, code_points)) {
+        continue;
+      }
+      bool ok = true;
+      for (auto cp : code_points) {
+        auto it = byte_level_decoder.find(cp);
+        if (it == byte_level_decoder.end()) {
+          ok = false;
+          break;
+        }
+        text += static_cast<char>(it->second);
+      }
+      if (!ok) {
+        text.clear();
+        continue;
+      }
+    } else if (byte_fallback && ParseByteFallback(piece, byte)) {
+      text = static_cast<char>(byte);
+    } else {
+      for (size_t pos = 0; pos < piece.size();) {
+        if (piece.compare(pos, kSentencePieceSpace.size(), kSentencePieceSpace) == 0) {
+          text += ' ';
+          pos += kSentencePieceSpace.size();
+        } else {
+          text += piece[pos++];
+        }
+      }
+    }
+    // Decode() hands out C strings, so texts with a null in them (<0x00>) are left to the GenAI API
+    table->has_text[id] = text.find('\0') == std::string::npos;
+  }
+  for (auto id : added_tokens) {
+    table->texts[id].clear();
+    table->has_text[id] = false;
+  }
+  if (!table->Verify(tokenizer)) {
+    spdlog::warn("Token text table of [{}] doesn't agree with the GenAI tokenizer; tokens will be decoded through the GenAI API", model_path);
+    return nullptr;
+  }
+  spdlog::info("Built token text table of [{}] with [{}] tokens", model_path, size);
+  return table;
+}
+
+bool TokenTextTable::Verify(const OgaTokenizer& tokenizer) const {
+  auto step = std::max<size_t>(1, texts.size() / kNumVerifiedTokens);
+  for (size_t id = 0; id < texts.size(); id += step) {
+    std::string_view expected = texts[id];
+    if (!has_text[id] || !IsStandaloneText(expected)) {
+      continue;
+    }
+    if (strips_leading_space && !expected.empty() && expected[0] == ' ') {
+      expected.remove_prefix(1);
+    }
+    auto token = static_cast<int32_t>(id);
+    auto decoded = tokenizer.Decode(&token, 1);
+    if (expected != static_cast<const char*>(decoded)) {
+      spdlog::debug("Token [{}] decodes to [{}] but the table has [{}]", id, static_cast<const char*>(decoded), expected);
+      return false;
+    }
+  }
+  return true;
+}
+
+TokenTextDecoder::TokenTextDecoder(const TokenTextTable& table0, const OgaTokenizer& tokenizer0)
+    : table(table0), tokenizer(tokenizer0) {
+}
+
+const char* TokenTextDecoder::Decode(int32_t token) {
+  std::string_view bytes;
+  if (!table.Lookup(token, bytes)) {
+    // whatever is pending won't be completed by an added token
+    text = pending;
+    pending.clear();
+    auto decoded = tokenizer.Decode(&token, 1);
+    text += static_cast<const char*>(decoded);
+    at_start &= text.empty();
+    return text.c_str();
+  }
+  if (at_start && table.StripsLeadingSpace() && !bytes.empty() && bytes[0] == ' ') {
+    bytes.remove_prefix(1);
+  }
+  at_start &= bytes.empty();
+  if (pending.empty() && CompleteUtf8Prefix(bytes) == bytes.size()) {
+    // the common case: a token of whole characters; its text in the table is null terminated
+    return bytes.data();
+  }
+  pending += bytes;
+  auto complete = CompleteUtf8Prefix(pending);
+  text.assign(pending, 0, complete);
+  pending.erase(0, complete);
+  return text.c_str();
+}
+}  // namespace oas
@@ -0,0 +1,62 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ort_genai.h"
+
+namespace oas {
+// The UTF-8 bytes of every token of a model's vocabulary, built at load time from its tokenizer.json so that
+// streams turn tokens into text with a lookup instead of a call through the GenAI C API per token.
+// Byte-level (GPT-2 style) vocabularies and SentencePiece style ones ('▁' for spaces, <0xNN> byte fallback)
+// are supported. Added and special tokens are left to the GenAI API.
+class TokenTextTable {
+ public:
+  // Returns null if the tokenizer isn't supported or the table doesn't agree with the GenAI API.
+  static std::unique_ptr<TokenTextTable> Create(const std::string& model_path, const OgaTokenizer& tokenizer);
+
+  // Returns false if the token has to be decoded by the GenAI API. bytes are followed by a null and contain none.
+  bool Lookup(int32_t token, std::string_view& bytes) const {
+    if (token < 0 || static_cast<size_t>(token) >= texts.size() || !has_text[token]) {
+      return false;
+    }
+    bytes = texts[token];
+    return true;
+  }
+  // Whether the decoded text drops the space the first token starts with (SentencePiece).
+  bool StripsLeadingSpace() const { return strips_leading_space; }
+  size_t Size() const { return texts.size(); }
+
+ private:
+  TokenTextTable() = default;
+  bool Verify(const OgaTokenizer& tokenizer) const;
+
+  std::vector<std::string> texts;
+  std::vector<bool> has_text;
+  bool strips_leading_space = false;
+};
+
+// Turns the tokens of one stream into text with a TokenTextTable.
+// Tokens can end in the middle of a UTF-8 sequence (byte fallback, byte-level merges), so their bytes are
+// assembled until the sequence is complete.
+class TokenTextDecoder {
+ public:
+  TokenTextDecoder(const TokenTextTable& table0, const OgaTokenizer& tokenizer0);
+
+  // Returns the text completed by token; valid until the next call.
+  const char* Decode(int32_t token);
+
+ private:
+  const TokenTextTable& table;
+  const OgaTokenizer& tokenizer;
+  std::string pending;  // bytes of an incomplete UTF-8 sequence
+  std::string text;
+  bool at_start = true;
+};
+}  // namespace oas
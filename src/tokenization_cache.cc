@@ -0,0 +1,201 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <algorithm>
+
+#include "spdlog/spdlog.h"
+#include "tokenization_cache.h"
+
+namespace oas {
+// Spliced prompts checked against encoding the whole prompt: all of the first ones, then one in kVerifyInterval.
+constexpr size_t kNumVerifiedFirst = 16;
+constexpr size_t kVerifyInterval = 100;
+// Bytes of the text after a boundary CheckBoundary encodes at most.
+constexpr size_t kMaxBoundaryHeadBytes = 32;
+
+static bool IsSpace(char c) {
+  return c == '\n' || c == '\r' || c == ' ' || c == '\t';
+}
+
+static bool IsSegmentBoundary(const std::string& prompt, size_t pos) {
+  if (prompt[pos - 1] != '\n') {
+    return false;
+  }
+  return !IsSpace(prompt[pos]);
+}
+
+static size_t EntryBytes(const std::string& key, const std::vector<int32_t>& tokens) {
+  // the key is stored twice: in the map and in the lru list
+  return 2 * key.size() + tokens.size() * sizeof(int32_t);
+}
+
+TokenizationCache::TokenizationCache(const OgaTokenizer& tokenizer0, size_t capacity_bytes0)
+    : tokenizer(tokenizer0), capacity_bytes(capacity_bytes0), anchor_tokens(EncodeWhole("\n")) {
+}
+
+std::vector<int32_t> TokenizationCache::Encode(const std::string& prompt) {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!stats.splicing_enabled) {
+      return EncodeWhole(prompt.c_str());
+    }
+  }
+  std::vector<int32_t> ret;
+  size_t num_segments = 0;
+  size_t begin = 0;
+  for (size_t pos = 1; pos <= prompt.size(); ++pos) {
+    if (pos < prompt.size() && !IsSegmentBoundary(prompt, pos)) {
+      continue;
+    }
+    if (!GetSegmentTokens(std::string_view(prompt).substr(begin, pos - begin), num_segments == 0, ret)) {
+      return EncodeWhole(prompt.c_str());
+    }
+    if (pos < prompt.size() && !CheckBoundary(prompt, begin, pos)) {
+      return StopSplicing(prompt);
+    }
+    ++num_segments;
+    begin = pos;
+  }
+  if (num_segments < 2) {
+    return ret;
+  }
+  bool verify;
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    ++num_spliced;
+    verify = num_spliced <= kNumVerifiedFirst || num_spliced % kVerifyInterval == 0;
+  }
+  if (!verify) {
+    return ret;
+  }
+  auto whole = EncodeWhole(prompt.c_str());
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    ++stats.num_verified;
+  }
+  return whole != ret ? StopSplicing(prompt) : ret;
+}
+
+std::vector<int32_t> TokenizationCache::StopSplicing(const std::string& prompt) {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    ++stats.num_mismatches;
+    if (stats.splicing_enabled) {
+      spdlog::warn("Tokens of a prompt encoded by segment differ from encoding it whole; encoding whole prompts from now on");
+      stats.splicing_enabled = false;
+    }
+  }
+  return EncodeWhole(prompt.c_str());
+}
+
+// The last line of the segment is encoded after a newline, like later segments are, once on its own and once
+// followed by the first word after the boundary; if a token spanned the boundary, the first encoding wouldn't
+// be a prefix of the second.
+bool TokenizationCache::CheckBoundary(const std::string& prompt, size_t segment_begin, size_t pos) {
+  auto line_end = pos;
+  while (line_end > segment_begin && IsSpace(prompt[line_end - 1])) {
+    --line_end;
+  }
+  auto line_begin = line_end > segment_begin ? prompt.rfind('\n', line_end - 1) : std::string::npos;
+  line_begin = line_begin == std::string::npos || line_begin < segment_begin ? segment_begin : line_begin + 1;
+  auto head_end = pos;
+  while (head_end < prompt.size() && head_end - pos < kMaxBoundaryHeadBytes && !IsSpace(prompt[head_end])) {
+    ++head_end;
+  }
+  // don't cut a UTF-8 sequence
+  while (head_end > pos + 1 && head_end < prompt.size() && (static_cast<unsigned char>(prompt[head_end]) & 0xC0) == 0x80) {
+    --head_end;
+  }
+  auto text = "\n" + prompt.substr(line_begin, head_end - line_begin);
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (checked_boundaries.count(text)) {
+      return true;
+    }
+  }
+  auto tail_tokens = EncodeWhole(text.substr(0, 1 + pos - line_begin).c_str());
+  auto tokens = EncodeWhole(text.c_str());
+  bool ok = tokens.size() >= tail_tokens.size() && std::equal(tail_tokens.begin(), tail_tokens.end(), tokens.begin());
+  std::lock_guard<std::mutex> lock(mtx);
+  ++stats.num_boundary_checks;
+  if (ok) {
+    // forgotten all at once when they'd take up more than the segments may
+    if (checked_boundaries_bytes + text.size() > capacity_bytes) {
+      checked_boundaries.clear();
+      checked_boundaries_bytes = 0;
+    }
+    checked_boundaries_bytes += text.size();
+    checked_boundaries.insert(std::move(text));
+  }
+  return ok;
+}
+
+TokenizationCacheStats TokenizationCache::GetStats() {
+  std::lock_guard<std::mutex> lock(mtx);
+  auto ret = stats;
+  ret.num_segments = segments.size();
+  return ret;
+}
+
+std::vector<int32_t> TokenizationCache::EncodeWhole(const char* str) const {
+  auto sequences = OgaSequences::Create();
+  tokenizer.Encode(str, *sequences);
+  return std::vector<int32_t>(sequences->SequenceData(0), sequences->SequenceData(0) + sequences->SequenceCount(0));
+}
+
+bool TokenizationCache::GetSegmentTokens(std::string_view segment, bool is_first, std::vector<int32_t>& tokens) {
+  std::string key;
+  key.reserve(segment.size() + 1);
+  if (is_first) {
+    key += '\0';
+  }
+  key += segment;
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto it = segments.find(key);
+    if (it != segments.end()) {
+      ++stats.num_hits;
+      stats.num_hit_chars += segment.size();
+      lru.splice(lru.begin(), lru, it->second.lru_it);
+      tokens.insert(tokens.end(), it->second.tokens.begin(), it->second.tokens.end());
+      return true;
+    }
+  }
+
+  std::vector<int32_t> segment_tokens;
+  if (is_first) {
+    segment_tokens = EncodeWhole(key.c_str() + 1);
+  } else {
+    segment_tokens = EncodeWhole(("\n" + key).c_str());
+    if (segment_tokens.size() < anchor_tokens.size() ||
+        !std::equal(anchor_tokens.begin(), anchor_tokens.end(), segment_tokens.begin())) {
+      // the segment merged with the newline before it
+      return false;
+    }
+    segment_tokens.erase(segment_tokens.begin(), segment_tokens.begin() + anchor_tokens.size());
+  }
+  tokens.insert(tokens.end(), segment_tokens.begin(), segment_tokens.end());
+
+  auto entry_bytes = EntryBytes(key, segment_tokens);
+  std::lock_guard<std::mutex> lock(mtx);
+  ++stats.num_misses;
+  if (entry_bytes > capacity_bytes || segments.count(key)) {
+    return true;
+  }
+  auto& entry = segments[key];
+  stats.num_bytes += entry_bytes;
+  entry.tokens = std::move(segment_tokens);
+  entry.lru_it = lru.insert(lru.begin(), key);
+  while (stats.num_bytes > capacity_bytes && !lru.empty()) {
+    Erase(segments.find(lru.back()));
+    ++stats.num_evicted;
+  }
+  return true;
+}
+
+void TokenizationCache::Erase(std::unordered_map<std::string, Segment>::iterator it) {
+  stats.num_bytes -= EntryBytes(it->first, it->second.tokens);
+  lru.erase(it->second.lru_it);
+  segments.erase(it);
+}
+}  // namespace oas
@@ -0,0 +1,75 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "ort_genai.h"
+
+namespace oas {
+struct TokenizationCacheStats {
+  size_t num_segments = 0;
+  size_t num_bytes = 0;
+  size_t num_hits = 0;  // segments whose tokens came from the cache
+  size_t num_misses = 0;  // segments that had to be encoded
+  size_t num_hit_chars = 0;  // prompt characters that didn't have to be encoded
+  size_t num_evicted = 0;
+  size_t num_boundary_checks = 0;  // segment boundaries re-encoded to check that the tokenizer keeps them apart
+  size_t num_verified = 0;  // spliced prompts checked against encoding the whole prompt
+  size_t num_mismatches = 0;
+  bool splicing_enabled = true;
+};
+
+// Memoizes the tokenization of a model's prompts by segment, so that prompts built from a fixed template
+// only encode their variable parts.
+// A prompt is split into segments that end with a run of newlines followed by a character that isn't
+// whitespace; tokenizers don't merge tokens across such boundaries. The first segment is encoded as the start
+// of the text and the others after a newline, so that prefixes the tokenizer adds to the start of a text
+// (BOS, SentencePiece's leading space) only end up in the first one.
+// Every boundary of a spliced prompt is checked by encoding the line before it together with the start of the
+// text after it (remembered once it passed), and a sample of spliced prompts is checked against encoding the
+// whole prompt. If either ever differs, splicing is turned off for the model and whole prompts are encoded from
+// then on. The check only looks a line and a word around each boundary, so the server only uses the cache if
+// asked to.
+class TokenizationCache {
+ public:
+  TokenizationCache(const OgaTokenizer& tokenizer0, size_t capacity_bytes0);
+
+  std::vector<int32_t> Encode(const std::string& prompt);
+  TokenizationCacheStats GetStats();
+
+ private:
+  struct Segment {
+    std::vector<int32_t> tokens;
+    std::list<std::string>::iterator lru_it;
+  };
+
+  std::vector<int32_t> EncodeWhole(const char* str) const;
+  // Returns false if the segment can't be encoded on its own.
+  bool GetSegmentTokens(std::string_view segment, bool is_first, std::vector<int32_t>& tokens);
+  // Returns whether no token spans the boundary at pos between the segment starting at segment_begin and the next.
+  bool CheckBoundary(const std::string& prompt, size_t segment_begin, size_t pos);
+  // Turns splicing off after a spliced prompt came out differently and encodes the prompt whole.
+  std::vector<int32_t> StopSplicing(const std::string& prompt);
+  void Erase(std::unordered_map<std::string, Segment>::iterator it);
+
+  const OgaTokenizer& tokenizer;
+  const size_t capacity_bytes;
+  std::vector<int32_t> anchor_tokens;  // tokens of the newline that later segments are encoded after
+  size_t num_spliced = 0;
+  std::unordered_map<std::string, Segment> segments;  // the first segment of a prompt is keyed with a leading '\0'
+  std::list<std::string> lru;  // most recently used first
+  std::unordered_set<std::string> checked_boundaries;  // texts around boundaries that passed CheckBoundary
+  size_t checked_boundaries_bytes = 0;
+  TokenizationCacheStats stats;
+  std::mutex mtx;
+};
+}  // namespace oas
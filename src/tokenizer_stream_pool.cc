@@ -0,0 +1,98 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "spdlog/spdlog.h"
+#include "tokenizer_stream_pool.h"
+
+namespace oas {
+TokenizerStreamPool::Lease::Lease(TokenizerStreamPool* pool0, std::unique_ptr<OgaTokenizerStream> stream0)
+    : pool(pool0), stream(std::move(stream0)) {
+}
+
+TokenizerStreamPool::Lease& TokenizerStreamPool::Lease::operator=(Lease&& other) {
+  if (this != &other) {
+    if (stream) {
+      pool->Return(std::move(stream));
+    }
+    pool = other.pool;
+    stream = std::move(other.stream);
+  }
+  return *this;
+}
+
+TokenizerStreamPool::Lease::~Lease() {
+  if (stream) {
+    pool->Return(std::move(stream));
+  }
+}
+
+TokenizerStreamPool::TokenizerStreamPool(const OgaTokenizer& tokenizer0, size_t capacity0)
+    : tokenizer(tokenizer0), capacity(capacity0), slots(new std::atomic<OgaTokenizerStream*>[capacity0]) {
+  for (size_t i = 0; i < capacity; ++i) {
+    slots[i] = nullptr;
+  }
+  try {
+    for (size_t i = 0; i < capacity; ++i) {
+      slots[i] = OgaTokenizerStream::Create(tokenizer).release();
+    }
+  } catch (...) {
+    for (size_t i = 0; i < capacity; ++i) {
+      delete slots[i].exchange(nullptr);
+    }
+    throw;
+  }
+}
+
+TokenizerStreamPool::~TokenizerStreamPool() {
+  for (size_t i = 0; i < capacity; ++i) {
+    delete slots[i].exchange(nullptr);
+  }
+}
+
+TokenizerStreamPool::Lease TokenizerStreamPool::Acquire() {
+  ++num_acquired;
+  for (size_t i = 0; i < capacity; ++i) {
+    if (slots[i].load(std::memory_order_relaxed)) {
+      if (auto stream = slots[i].exchange(nullptr, std::memory_order_acquire)) {
+        return Lease(this, std::unique_ptr<OgaTokenizerStream>(stream));
+      }
+    }
+  }
+  ++num_misses;
+  return Lease(this, OgaTokenizerStream::Create(tokenizer));
+}
+
+TokenizerStreamPoolStats TokenizerStreamPool::GetStats() const {
+  TokenizerStreamPoolStats ret;
+  ret.capacity = capacity;
+  for (size_t i = 0; i < capacity; ++i) {
+    ret.num_idle += slots[i].load(std::memory_order_relaxed) != nullptr;
+  }
+  ret.num_acquired = num_acquired;
+  ret.num_misses = num_misses;
+  return ret;
+}
+
+void TokenizerStreamPool::Return(std::unique_ptr<OgaTokenizerStream> stream) {
+  stream.reset();  // it may hold state of the text it decoded
+  for (size_t i = 0; i < capacity; ++i) {
+    if (slots[i].load(std::memory_order_relaxed)) {
+      continue;
+    }
+    if (!stream) {
+      try {
+        stream = OgaTokenizerStream::Create(tokenizer);
+      } catch (const std::exception& e) {
+        spdlog::error("Could not replace a tokenizer stream: {}", e.what());
+        return;
+      }
+    }
+    OgaTokenizerStream* expected = nullptr;
+    if (slots[i].compare_exchange_strong(expected, stream.get(), std::memory_order_release, std::memory_order_relaxed)) {
+      stream.release();
+      return;
+    }
+  }
+  // the pool is full; the replacement, if any, is dropped
+}
+}  // namespace oas
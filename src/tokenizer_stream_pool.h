@@ -0,0 +1,62 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+#include "ort_genai.h"
+
+namespace oas {
+struct TokenizerStreamPoolStats {
+  size_t capacity = 0;
+  size_t num_idle = 0;  // fresh streams waiting in the pool
+  size_t num_acquired = 0;
+  size_t num_misses = 0;  // streams created on the request path since the pool was empty
+};
+
+// Fresh OgaTokenizerStreams of a model, so that every stream decodes with an OgaTokenizerStream of its own
+// without creating one on the request path.
+// The pool is a fixed array of slots that streams are swapped in and out of with atomics, so acquiring and
+// returning a stream never takes a lock. The GenAI API can't reset a stream, so a returned stream is replaced
+// by a new one once the response it decoded has been written. If the pool is empty a stream is created on
+// the spot.
+class TokenizerStreamPool {
+ public:
+  // Returns a stream to its pool when destroyed.
+  class Lease {
+   public:
+    Lease() = default;
+    Lease(Lease&& other) = default;
+    Lease& operator=(Lease&& other);
+    ~Lease();
+
+    OgaTokenizerStream* operator->() const { return stream.get(); }
+    explicit operator bool() const { return stream != nullptr; }
+
+   private:
+    friend class TokenizerStreamPool;
+    Lease(TokenizerStreamPool* pool0, std::unique_ptr<OgaTokenizerStream> stream0);
+
+    TokenizerStreamPool* pool = nullptr;
+    std::unique_ptr<OgaTokenizerStream> stream;
+  };
+
+  // Fills all capacity slots; throws if a stream can't be created.
+  TokenizerStreamPool(const OgaTokenizer& tokenizer0, size_t capacity0);
+  ~TokenizerStreamPool();
+
+  Lease Acquire();
+  TokenizerStreamPoolStats GetStats() const;
+
+ private:
+  void Return(std::unique_ptr<OgaTokenizerStream> stream);
+
+  const OgaTokenizer& tokenizer;
+  const size_t capacity;
+  std::unique_ptr<std::atomic<OgaTokenizerStream*>[]> slots;  // null slots are empty
+  std::atomic<size_t> num_acquired{0};
+  std::atomic<size_t> num_misses{0};
+};
+}  // namespace oas
@@ -4,6 +4,8 @@
 #pragma once
 
 #include <exception>
+#include <string>
+#include <string_view>
 #include "json.hpp"
 
 namespace oas {
@@ -13,7 +15,14 @@ enum class Status {
   kModelAlreadyDownloaded,
   kModelNotDownloaded,
   kModelNotRecognized,
-  kModelAlreadyLoaded
+  kModelAlreadyLoaded,
+  kModelNotLoaded,
+  kMemoryBudgetExceeded,
+  kQueueFull,
+  kQueueTimeout,
+  kDeadlineExceeded,
+  kCancelled,
+  kKvCacheBudgetExceeded
 };
 
 struct OasException : std::exception {
@@ -24,77 +33,118 @@ struct OasException : std::exception {
   const std::string err_;
 };
 
-static nlohmann::json FormatStreamingChatResponse(const char* content, bool stop) {
-  /*
-  OpenAI format
-      /*
-      {
-          "id": "chatcmpl-123",
-          "object": "chat.completion.chunk",
-          "created": 1694268190,
-          "model": "gpt-4o-mini",
-          "system_fingerprint": "fp_44709d6fcb",
-          "choices": [
-              {
-                  "index": 0,
-                  "delta": {
-                      "role": "assistant",
-                      "content": ""
-                  },
-                  "logprobs": null,
-                  "finish_reason": null
-              }
-          ]
+// Appends str escaped as the contents of a JSON string, byte for byte the way nlohmann::json::dump() does
+// with error_handler_t::replace, i.e. invalid UTF-8 becomes U+FFFD.
+static void AppendJsonEscaped(std::string& out, std::string_view str) {
+  static constexpr char kHexDigits[] = "0123456789abcdef";
+  static constexpr std::string_view kReplacementChar = "\xEF\xBF\xBD";
+  size_t i = 0;
+  while (i < str.size()) {
+    // copy the run of characters that don't need escaping in one go
+    auto run_begin = i;
+    while (i < str.size()) {
+      auto c = static_cast<unsigned char>(str[i]);
+      if (c < 0x20 || c == '"' || c == '\\' || c >= 0x80) {
+        break;
       }
-      */
-  // std::cout << "forming response, content: " << content << "\n";
-  nlohmann::json response;
-  response["id"] = "ort-app-server-123";
-  response["object"] = "chat.completion.chunk";
-  nlohmann::json choice_object;
-  choice_object["index"] = 0;
-  nlohmann::json delta_object;
-  delta_object["content"] = content;
-  choice_object["delta"] = delta_object;
-  response["choices"] = {choice_object};
-  return response;
-}
+      ++i;
+    }
+    out.append(str, run_begin, i - run_begin);
+    if (i == str.size()) {
+      break;
+    }
+
+    auto c = static_cast<unsigned char>(str[i]);
+    if (c < 0x80) {
+      out += '\\';
+      switch (c) {
+        case '"': out += '"'; break;
+        case '\\': out += '\\'; break;
+        case '\b': out += 'b'; break;
+        case '\f': out += 'f'; break;
+        case '\n': out += 'n'; break;
+        case '\r': out += 'r'; break;
+        case '\t': out += 't'; break;
+        default: {
+          out += "u00";
+          out += kHexDigits[c >> 4];
+          out += kHexDigits[c & 0xF];
+        }
+      }
+      ++i;
+      continue;
+    }
 
-static nlohmann::json FormatNonStreamingChatResponse(const char* content) {
-  /*
-  OpenAI format
-{
-  "id": "chatcmpl-123",
-  "object": "chat.completion",
-  "created": 1677652288,
-  "model": "gpt-4o-mini",
-  "system_fingerprint": "fp_44709d6fcb",
-  "choices": [{
-    "index": 0,
-    "message": {
-      "role": "assistant",
-      "content": "\n\nHello there, how may I assist you today?",
-    },
-    "logprobs": null,
-    "finish_reason": "stop"
-  }],
-  "usage": {
-    "prompt_tokens": 9,
-    "completion_tokens": 12,
-    "total_tokens": 21
+    // multi-byte sequence; the allowed range of the second byte depends on the first (Unicode table 3-7)
+    size_t len = 0;
+    unsigned char second_min = 0x80, second_max = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) {
+      len = 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+      len = 3;
+      second_min = c == 0xE0 ? 0xA0 : 0x80;
+      second_max = c == 0xED ? 0x9F : 0xBF;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+      len = 4;
+      second_min = c == 0xF0 ? 0x90 : 0x80;
+      second_max = c == 0xF4 ? 0x8F : 0xBF;
+    }
+    if (!len) {
+      out += kReplacementChar;
+      ++i;
+      continue;
+    }
+    size_t n = 1;
+    for (; n < len && i + n < str.size(); ++n) {
+      auto cont = static_cast<unsigned char>(str[i + n]);
+      if (cont < (n == 1 ? second_min : 0x80) || cont > (n == 1 ? second_max : 0xBF)) {
+        break;
+      }
+    }
+    if (n == len) {
+      out.append(str, i, len);
+    } else {
+      // the byte that broke the sequence starts over
+      out += kReplacementChar;
+    }
+    i += n;
   }
-}      */
-  // std::cout << "forming response, content: " << content << "\n";
-  nlohmann::json response;
-  response["id"] = "ort-app-server-123";
-  response["object"] = "chat.completion";
-  nlohmann::json choice_object;
-  choice_object["index"] = 0;
-  nlohmann::json message_object;
-  message_object["content"] = content;
-  choice_object["message"] = message_object;
-  response["choices"] = {choice_object};
-  return response;
+}
+
+// Event for a chunk of a streaming chat response, with the content spliced in between.
+// OpenAI format (only id, object and choices[].index/delta.content are filled in):
+// {"id": "chatcmpl-123", "object": "chat.completion.chunk", "created": 1694268190, "model": "gpt-4o-mini",
+//  "choices": [{"index": 0, "delta": {"role": "assistant", "content": ""}, "logprobs": null, "finish_reason": null}]}
+constexpr std::string_view kStreamingChatResponsePrefix = "data: {\"choices\":[{\"delta\":{\"content\":\"";
+constexpr std::string_view kStreamingChatResponseSuffix =
+    "\"},\"index\":0}],\"id\":\"ort-app-server-123\",\"object\":\"chat.completion.chunk\"}\n\n";
+// The last chunk of a response also carries its finish_reason.
+constexpr std::string_view kStreamingChatResponseStopSuffix =
+    "\"},\"finish_reason\":\"stop\",\"index\":0}],\"id\":\"ort-app-server-123\",\"object\":\"chat.completion.chunk\"}\n\n";
+
+// Appends the server-sent event of a streaming chat response chunk to out, which streams reuse for every token.
+// stop marks the last chunk.
+static void AppendStreamingChatResponse(std::string& out, std::string_view content, bool stop) {
+  out += kStreamingChatResponsePrefix;
+  AppendJsonEscaped(out, content);
+  out += stop ? kStreamingChatResponseStopSuffix : kStreamingChatResponseSuffix;
+}
+
+// OpenAI format (only id, object and choices[].index/message.content are filled in):
+// {"id": "chatcmpl-123", "object": "chat.completion", "created": 1677652288, "model": "gpt-4o-mini",
+//  "choices": [{"index": 0, "message": {"role": "assistant", "content": "Hello there"}, "logprobs": null,
+//               "finish_reason": "stop"}],
+//  "usage": {"prompt_tokens": 9, "completion_tokens": 12, "total_tokens": 21}}
+constexpr std::string_view kNonStreamingChatResponsePrefix = "{\"choices\":[{\"index\":0,\"message\":{\"content\":\"";
+constexpr std::string_view kNonStreamingChatResponseSuffix = "\"}}],\"id\":\"ort-app-server-123\",\"object\":\"chat.completion\"}";
+
+static std::string FormatNonStreamingChatResponse(std::string_view content) {
+  std::string ret;
+  ret.reserve(kNonStreamingChatResponsePrefix.size() + content.size() + kNonStreamingChatResponseSuffix.size());
+  ret += kNonStreamingChatResponsePrefix;
+  AppendJsonEscaped(ret, content);
+  ret += kNonStreamingChatResponseSuffix;
+  return ret;
 }
 
 static bool ContainsJsonKey(const nlohmann::json& body, const std::string& key) {
@@ -0,0 +1,96 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+// Decodes a stream of random tokens of a model with an OgaTokenizerStream and with its TokenTextTable, reports
+// how long each takes and fails if they produce different text.
+// Usage: benchmark_token_text_table <model_path> [num_tokens]
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "token_text_table.h"
+
+namespace {
+constexpr size_t kDefaultNumTokens = 100000;
+
+// Whether bytes are whole UTF-8 characters; the GenAI API can't decode partial sequences on their own.
+bool IsValidUtf8(std::string_view bytes) {
+  for (size_t i = 0; i < bytes.size();) {
+    auto lead = static_cast<unsigned char>(bytes[i]);
+    size_t len = lead < 0x80 ? 1 : (lead & 0xE0) == 0xC0 ? 2 : (lead & 0xF0) == 0xE0 ? 3 : (lead & 0xF8) == 0xF0 ? 4 : 0;
+    if (!len || i + len > bytes.size()) {
+      return false;
+    }
+    for (size_t k = 1; k < len; ++k) {
+      if ((static_cast<unsigned char>(bytes[i + k]) & 0xC0) != 0x80) {
+        return false;
+      }
+    }
+    i += len;
+  }
+  return true;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " <model_path> [num_tokens]\n";
+    return 2;
+  }
+  std::string model_path = argv[1];
+  size_t num_tokens = argc > 2 ? std::stoul(argv[2]) : kDefaultNumTokens;
+
+  auto model = OgaModel::Create(model_path.c_str());
+  auto tokenizer = OgaTokenizer::Create(*model);
+  auto table = oas::TokenTextTable::Create(model_path, *tokenizer);
+  if (!table) {
+    std::cerr << "No token text table for [" << model_path << "]\n";
+    return 1;
+  }
+
+  std::vector<int32_t> candidates;
+  std::string_view bytes;
+  for (size_t id = 0; id < table->Size(); ++id) {
+    if (table->Lookup(static_cast<int32_t>(id), bytes) && IsValidUtf8(bytes)) {
+      candidates.push_back(static_cast<int32_t>(id));
+    }
+  }
+  if (candidates.empty()) {
+    std::cerr << "No tokens to decode in the table of [" << model_path << "]\n";
+    return 1;
+  }
+  std::vector<int32_t> tokens(num_tokens);
+  uint64_t state = 42;
+  for (auto& token : tokens) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;  // deterministic, spread over the vocabulary
+    token = candidates[(state >> 33) % candidates.size()];
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto tokenizer_stream = OgaTokenizerStream::Create(*tokenizer);
+  std::string api_text;
+  for (auto token : tokens) {
+    api_text += tokenizer_stream->Decode(token);
+  }
+  auto api_done = std::chrono::steady_clock::now();
+  oas::TokenTextDecoder decoder(*table, *tokenizer);
+  std::string table_text;
+  for (auto token : tokens) {
+    table_text += decoder.Decode(token);
+  }
+  auto table_done = std::chrono::steady_clock::now();
+
+  auto ns_per_token = [num_tokens](auto duration) {
+    return std::chrono::duration<double, std::nano>(duration).count() / num_tokens;
+  };
+  std::cout << "Decoding " << num_tokens << " tokens took " << ns_per_token(api_done - start)
+            << " ns/token through OgaTokenizerStream and " << ns_per_token(table_done - api_done)
+            << " ns/token through the table\n";
+  if (api_text != table_text) {
+    std::cerr << "Texts differ; the table must not be used with [" << model_path << "]\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,73 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+// Checks that ConcurrencyLimiter shrinks its limit to the minimum while step latency stays well above the
+// baseline and grows it back to the maximum once latency recovers.
+
+#include <algorithm>
+#include <iostream>
+
+#include "concurrency_limiter.h"
+
+namespace {
+constexpr size_t kMinLimit = 2;
+constexpr size_t kMaxLimit = 32;
+constexpr double kLatencyTolerance = 1.5;
+constexpr double kFastStepMs = 10;
+constexpr double kSlowStepMs = 100;
+constexpr size_t kMaxSteps = 1000;
+
+// Feeds steps of step_latency_ms with a full batch until the limit reaches target. Returns the number of
+// steps that took, or kMaxSteps if it never did.
+size_t StepsUntilLimit(oas::ConcurrencyLimiter& limiter, double step_latency_ms, size_t target, size_t& min_seen) {
+  for (size_t i = 0; i < kMaxSteps; ++i) {
+    limiter.OnSample(step_latency_ms, limiter.GetLimit());
+    min_seen = std::min(min_seen, limiter.GetLimit());
+    if (limiter.GetLimit() == target) {
+      return i;
+    }
+  }
+  return kMaxSteps;
+}
+}  // namespace
+
+int main() {
+  size_t num_failures = 0;
+  oas::ConcurrencyLimiter limiter(kMinLimit, kMaxLimit, kLatencyTolerance);
+  size_t min_seen = limiter.GetLimit();
+  for (size_t i = 0; i < 100; ++i) {
+    limiter.OnSample(kFastStepMs, limiter.GetLimit());
+  }
+  if (limiter.GetLimit() != kMaxLimit) {
+    std::cerr << "Steady latency moved the limit to " << limiter.GetLimit() << "\n";
+    ++num_failures;
+  }
+
+  auto shrink_steps = StepsUntilLimit(limiter, kSlowStepMs, kMinLimit, min_seen);
+  std::cout << "Shrunk to " << limiter.GetLimit() << " in " << shrink_steps << " slow steps\n";
+  if (shrink_steps == kMaxSteps) {
+    std::cerr << "The limit stuck at " << limiter.GetLimit() << " while latency was " << kSlowStepMs / kFastStepMs
+              << "x the baseline\n";
+    ++num_failures;
+  }
+  // keep it overloaded; the limit must hold at the minimum rather than drop below it
+  StepsUntilLimit(limiter, kSlowStepMs, 0, min_seen);
+  if (min_seen < kMinLimit) {
+    std::cerr << "The limit dropped to " << min_seen << ", below the minimum of " << kMinLimit << "\n";
+    ++num_failures;
+  }
+
+  auto grow_steps = StepsUntilLimit(limiter, kFastStepMs, kMaxLimit, min_seen);
+  std::cout << "Grew back to " << limiter.GetLimit() << " in " << grow_steps << " fast steps\n";
+  if (grow_steps == kMaxSteps) {
+    std::cerr << "The limit stuck at " << limiter.GetLimit() << " after latency recovered\n";
+    ++num_failures;
+  }
+
+  if (num_failures) {
+    std::cerr << num_failures << " checks failed\n";
+    return 1;
+  }
+  std::cout << "All limiter checks passed\n";
+  return 0;
+}
@@ -0,0 +1,106 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+// Checks that the chat response templates in utils.h escape their content byte for byte like
+// nlohmann::json::dump() with error_handler_t::replace, and that the events they produce are valid JSON.
+
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "json.hpp"
+#include "utils.h"
+
+using json = nlohmann::json;
+
+namespace {
+constexpr size_t kNumStrings = 2000000;
+constexpr size_t kMaxLength = 16;
+
+// Random bytes weighted towards the ones escaping cares about: control characters, quotes, backslashes and the
+// lead and continuation bytes of UTF-8 sequences, valid or not.
+std::string RandomString(std::mt19937& rng) {
+  std::uniform_int_distribution<size_t> length_dist(0, kMaxLength);
+  std::uniform_int_distribution<int> class_dist(0, 99);
+  std::uniform_int_distribution<int> byte_dist(0, 255);
+  std::string ret(length_dist(rng), '\0');
+  for (auto& c : ret) {
+    auto byte_class = class_dist(rng);
+    if (byte_class < 30) {
+      c = static_cast<char>(0x20 + byte_dist(rng) % 0x5F);
+    } else if (byte_class < 40) {
+      c = static_cast<char>(byte_dist(rng) % 0x20);
+    } else if (byte_class < 45) {
+      c = byte_dist(rng) % 2 ? '"' : '\\';
+    } else {
+      c = static_cast<char>(0x80 + byte_dist(rng) % 0x80);
+    }
+  }
+  return ret;
+}
+
+std::string DumpEscaped(const std::string& str) {
+  auto dumped = json(str).dump(-1, ' ', false, json::error_handler_t::replace);
+  return dumped.substr(1, dumped.size() - 2);
+}
+
+std::string ToHex(const std::string& str) {
+  std::string ret;
+  char buf[4];
+  for (auto c : str) {
+    std::snprintf(buf, sizeof(buf), "%02x ", static_cast<unsigned char>(c));
+    ret += buf;
+  }
+  return ret;
+}
+
+bool CheckEvent(const std::string& event, bool stop) {
+  constexpr std::string_view kDataPrefix = "data: ";
+  if (event.compare(0, kDataPrefix.size(), kDataPrefix) || event.size() < kDataPrefix.size() + 2 ||
+      event.compare(event.size() - 2, 2, "\n\n")) {
+    return false;
+  }
+  auto chunk = json::parse(event.substr(kDataPrefix.size()), nullptr, false);
+  if (chunk.is_discarded()) {
+    return false;
+  }
+  const auto& choice = chunk["choices"][0];
+  return stop ? choice.value("finish_reason", "") == "stop" : !choice.contains("finish_reason");
+}
+}  // namespace
+
+int main() {
+  std::mt19937 rng(42);
+  size_t num_failures = 0;
+  for (size_t i = 0; i < kNumStrings; ++i) {
+    auto str = RandomString(rng);
+    std::string escaped;
+    oas::AppendJsonEscaped(escaped, str);
+    if (escaped != DumpEscaped(str)) {
+      if (num_failures++ < 10) {
+        std::cerr << "Escaping differs from dump() for [" << ToHex(str) << "]: [" << escaped << "] vs ["
+                  << DumpEscaped(str) << "]\n";
+      }
+      continue;
+    }
+    if (i % 1000) {
+      continue;
+    }
+    std::string event;
+    bool stop = i % 2000 == 0;
+    oas::AppendStreamingChatResponse(event, str, stop);
+    if (!CheckEvent(event, stop) ||
+        json::parse(oas::FormatNonStreamingChatResponse(str), nullptr, false).is_discarded()) {
+      if (num_failures++ < 10) {
+        std::cerr << "Invalid chat response for [" << ToHex(str) << "]: [" << event << "]\n";
+      }
+    }
+  }
+  if (num_failures) {
+    std::cerr << num_failures << " of " << kNumStrings << " strings failed\n";
+    return 1;
+  }
+  std::cout << "All " << kNumStrings << " strings escaped like dump()\n";
+  return 0;
+}
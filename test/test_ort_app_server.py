@@ -34,7 +34,8 @@ def pull_model(model_id):
 
 def load_model(model_id):
     print("Loading model (this might take a while): ", model_id)
-    req_body = '{"model": "%s"}' % (model_id)
+    # without "wait" the server answers 202 as soon as the load starts, before it's known to succeed
+    req_body = '{"model": "%s", "wait": true}' % (model_id)
     j = json.loads(req_body)
     res = requests.post(base_url + "/load", json=j)
     if (res.ok):
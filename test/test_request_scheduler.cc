@@ -0,0 +1,111 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+// Checks that RequestScheduler shares a model between tenants by weight, that the sjf queue policy admits
+// short requests first and that aging keeps it from starving a long request behind a stream of short ones.
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "generation_engine.h"
+#include "request_scheduler.h"
+
+namespace {
+constexpr std::chrono::milliseconds kArrivalInterval{5};
+
+size_t num_failures = 0;
+
+void Check(bool ok, const std::string& what) {
+  if (!ok) {
+    ++num_failures;
+    std::cerr << "FAILED: " << what << "\n";
+  }
+}
+
+// A request without a prompt that is expected to generate max_length tokens.
+std::shared_ptr<oas::GenerationRequest> MakeRequest(const std::string& tenant, size_t max_length) {
+  auto request = std::make_shared<oas::GenerationRequest>(std::vector<int32_t>{}, nullptr);
+  request->tenant = tenant;
+  request->max_length = max_length;
+  return request;
+}
+
+bool AdmitAll(const oas::GenerationRequest&) { return true; }
+
+void TestWeightedShares() {
+  oas::RequestScheduler scheduler({{"heavy", 3}, {"light", 1}}, oas::CreateQueuePolicy("fcfs", 0));
+  constexpr size_t kNumRequests = 400;
+  for (size_t i = 0; i < kNumRequests; ++i) {
+    scheduler.Push(MakeRequest("heavy", 64));
+    scheduler.Push(MakeRequest("light", 64));
+  }
+  // while both tenants are backlogged the heavy one gets 3 of every 4 slots; the admitted requests keep
+  // running, since completing one that generated nothing would refund its tenant the tokens it was charged
+  std::unordered_map<std::string, size_t> num_admitted;
+  for (size_t i = 0; i < kNumRequests; ++i) {
+    auto request = scheduler.Pop(AdmitAll);
+    ++num_admitted[request->tenant];
+  }
+  auto heavy = num_admitted["heavy"];
+  std::cout << "Weighted shares: heavy " << heavy << ", light " << num_admitted["light"] << "\n";
+  Check(heavy >= kNumRequests * 3 / 4 - 8 && heavy <= kNumRequests * 3 / 4 + 8,
+        "tenants of weight 3 and 1 share the admissions 3:1");
+
+  // requests that can't be admitted are skipped over, whatever their tenant's credit
+  while (scheduler.Pop([](const oas::GenerationRequest& request) { return request.tenant == "light"; })) {
+  }
+  Check(scheduler.Size() == kNumRequests - heavy, "skipped requests stay queued");
+}
+
+void TestShortestJobFirst() {
+  oas::RequestScheduler scheduler({}, oas::CreateQueuePolicy("sjf", 0));
+  for (size_t max_length : {300, 100, 200}) {
+    scheduler.Push(MakeRequest(oas::kDefaultTenant, max_length));
+  }
+  std::vector<size_t> order;
+  while (auto request = scheduler.Pop(AdmitAll)) {
+    order.push_back(request->max_length);
+  }
+  Check(order == std::vector<size_t>{100, 200, 300}, "sjf admits the shortest request first");
+}
+
+// Keeps one short request arriving per pop and returns how many pops it took to admit a long request
+// queued up front, or max_pops if it never was.
+size_t PopsUntilLongRequestAdmitted(double aging_tokens_per_sec, size_t max_pops) {
+  oas::RequestScheduler scheduler({}, oas::CreateQueuePolicy("sjf", aging_tokens_per_sec));
+  scheduler.Push(MakeRequest(oas::kDefaultTenant, 1000));
+  for (size_t i = 0; i < max_pops; ++i) {
+    scheduler.Push(MakeRequest(oas::kDefaultTenant, 10));
+    std::this_thread::sleep_for(kArrivalInterval);
+    if (scheduler.Pop(AdmitAll)->max_length == 1000) {
+      return i;
+    }
+  }
+  return max_pops;
+}
+
+void TestAging() {
+  constexpr size_t kMaxPops = 100;
+  Check(PopsUntilLongRequestAdmitted(0, 20) == 20, "without aging short requests keep overtaking a long one");
+  // at 20000 tokens/s the long request catches up with the new short ones after about 50ms, i.e. 10 pops
+  auto num_pops = PopsUntilLongRequestAdmitted(20000, kMaxPops);
+  std::cout << "Aging: long request admitted after " << num_pops << " pops\n";
+  Check(num_pops < kMaxPops, "aging admits a long request behind a stream of short ones");
+}
+}  // namespace
+
+int main() {
+  TestWeightedShares();
+  TestShortestJobFirst();
+  TestAging();
+  if (num_failures) {
+    std::cerr << num_failures << " checks failed\n";
+    return 1;
+  }
+  std::cout << "All scheduler checks passed\n";
+  return 0;
+}